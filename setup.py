@@ -1,3 +1,4 @@
+import os
 import sys
 from pathlib import Path
 from site import getsitepackages, getusersitepackages
@@ -12,6 +13,26 @@ compiletime_dirs = [*pvxslibs.__path__, *epicscorelibs.__path__]
 runtime_dirs = [*getsitepackages(), getusersitepackages(), "@loader_path"] if sys.platform != "win32" else []
 extra_compile_args=['-D_GLIBCXX_USE_CXX11_ABI=0'] if sys.platform.startswith("linux") else []
 
+# compile and link options shared by every extension
+extension_args = dict(
+    extra_compile_args=extra_compile_args,
+    include_dirs=[
+        *[str(Path(mod_dir) / "include") for mod_dir in compiletime_dirs],
+        # path to this project's src directory
+        Path(__file__).parent.resolve() / 'src',
+    ],
+    library_dirs=[
+        str(Path(mod_dir) / "lib") for mod_dir in compiletime_dirs
+    ],
+    runtime_library_dirs=[
+        *[str(Path(base_dir) / "pvxslibs" / "lib") for base_dir in runtime_dirs],
+        *[str(Path(base_dir) / "epicscorelibs" / "lib") for base_dir in runtime_dirs],
+    ],
+    libraries=["pvxs", "event_core", "Com"],
+    language='c++',
+    cxx_std=11,
+)
+
 # declare pybind11 extension
 ext_modules = [
     Pybind11Extension(
@@ -23,25 +44,20 @@ ext_modules = [
             'src/nt.cpp',
             'src/server.cpp',
         ],
-        extra_compile_args=extra_compile_args,
-        include_dirs=[
-            *[str(Path(mod_dir) / "include") for mod_dir in compiletime_dirs],
-            # path to this project's src directory
-            Path(__file__).parent.resolve() / 'src',
-        ],
-        library_dirs=[
-            str(Path(mod_dir) / "lib") for mod_dir in compiletime_dirs
-        ],
-        runtime_library_dirs=[
-            *[str(Path(base_dir) / "pvxslibs" / "lib") for base_dir in runtime_dirs],
-            *[str(Path(base_dir) / "epicscorelibs" / "lib") for base_dir in runtime_dirs],
-        ],
-        libraries=["pvxs", "event_core", "Com"],
-        language='c++',
-        cxx_std=11,
+        **extension_args,
     ),
 ]
 
+# native type caster benchmarks, only built on request (AIOPVXS_BENCH=1)
+if os.environ.get("AIOPVXS_BENCH", "0") not in ("", "0"):
+    ext_modules.append(
+        Pybind11Extension(
+            name = 'aiopvxs_bench',
+            sources = ['src/bench_casters.cpp'],
+            **extension_args,
+        )
+    )
+
 setup(
     ext_modules=ext_modules,
     # include files specified in MANIFEST.in
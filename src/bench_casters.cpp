@@ -0,0 +1,182 @@
+/*
+ * Project: aiopvxs
+ * File:    bench_casters.cpp
+ *
+ * This file is part of aiopvxs.
+ *
+ * https://github.com/m2es3h/aiopvxs
+ *
+ * Copyright (C) Michael Smith. All rights reserved.
+ *
+ * aiopvxs is free software: you can redistribute it and/or modify it
+ * under the terms of The 3-Clause BSD License.
+ *
+ * https://opensource.org/license/bsd-3-clause
+ *
+ * aiopvxs is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/*
+ * Optional extension module with native timings of the shared_array type
+ * caster in pvxs_types.hpp. Only built when AIOPVXS_BENCH is set, see
+ * setup.py, and driven by src/tests/benchmark.py --casters.
+ */
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+
+#include <pvxs/data.h>
+
+#include "pvxs_types.hpp"
+
+namespace py = pybind11;
+
+/*
+ * heap_in_use
+ *
+ * Bytes allocated from the C heap (malloc and operator new), or -1 where the
+ * C library can not tell.
+ *
+ */
+long long heap_in_use() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+    return static_cast<long long>(info.uordblks + info.hblkhd);
+#else
+    return -1;
+#endif
+}
+
+/*
+ * measure
+ *
+ * Calls call() until min_time has passed (at least 3 times) and returns a
+ * dictionary with the time per call and throughput. Allocations are counted
+ * in a second pass that keeps the results alive, so that what each call
+ * allocates is still in use when the totals are read. GIL must be held.
+ *
+ */
+template <typename Result, typename F>
+py::dict measure(const std::string& name, const std::string& format, size_t items,
+                 size_t nbytes, double min_time, F call) {
+    using clock = std::chrono::steady_clock;
+
+    // warm up, eg. module imports
+    call();
+
+    size_t calls = 0;
+    std::chrono::duration<double> elapsed(0.0);
+    auto start = clock::now();
+    do {
+        Result result = call();
+        (void)result;
+        calls++;
+        elapsed = clock::now() - start;
+    } while (calls < 3 || elapsed.count() < min_time);
+
+    const size_t kept_calls = 4;
+    std::vector<Result> kept;
+    kept.reserve(kept_calls);
+    py::object allocated_blocks = py::module_::import("sys").attr("getallocatedblocks");
+    auto blocks = allocated_blocks().cast<py::ssize_t>();
+    auto heap = heap_in_use();
+    for (size_t i = 0; i < kept_calls; i++)
+        kept.push_back(call());
+    blocks = allocated_blocks().cast<py::ssize_t>() - blocks;
+    auto heap_after = heap_in_use();
+    kept.clear();
+
+    double seconds_per_call = elapsed.count() / static_cast<double>(calls);
+    py::dict py_result;
+    py_result["case"] = name;
+    py_result["format"] = format;
+    py_result["items"] = items;
+    py_result["bytes"] = nbytes;
+    py_result["calls"] = calls;
+    py_result["ns_per_call"] = seconds_per_call * 1e9;
+    py_result["bytes_per_sec"] = static_cast<double>(nbytes) / seconds_per_call;
+    py_result["py_blocks_per_call"] = static_cast<double>(blocks) / kept_calls;
+    if (heap >= 0 && heap_after >= 0)
+        py_result["heap_bytes_per_call"] = static_cast<double>(heap_after - heap) / kept_calls;
+    else
+        py_result["heap_bytes_per_call"] = py::none();
+    return py_result;
+}
+
+shared_array<const void> load(py::handle src) {
+    return src.cast<shared_array<const void>>();
+}
+
+/*
+ * bench_casters
+ *
+ * Times both directions of the shared_array type caster for every numeric
+ * array.array type code and number of items, from buffers (adopted when
+ * read-only, copied when writable), lists and tuples, plus lists of str.
+ *
+ */
+py::list bench_casters(const std::vector<size_t>& sizes, const std::vector<std::string>& formats,
+                       double min_time) {
+    py::object array_array = py::module_::import("array").attr("array");
+    py::list results;
+
+    for (auto items : sizes) {
+        for (auto& format : formats) {
+            py::object arr = array_array(format, py::bytes(std::string(
+                items * array_array(format).attr("itemsize").cast<size_t>(), '\0')));
+            size_t nbytes = items * arr.attr("itemsize").cast<size_t>();
+
+            py::object readonly = py::memoryview(arr).attr("toreadonly")();
+            py::object as_list = arr.attr("tolist")();
+            py::object as_tuple = py::tuple(as_list);
+            auto sa = load(arr);
+
+            results.append(measure<shared_array<const void>>("load_buffer_adopt", format, items, nbytes, min_time,
+                                                             [&]() { return load(readonly); }));
+            results.append(measure<shared_array<const void>>("load_buffer_copy", format, items, nbytes, min_time,
+                                                             [&]() { return load(arr); }));
+            results.append(measure<shared_array<const void>>("load_list", format, items, nbytes, min_time,
+                                                             [&]() { return load(as_list); }));
+            results.append(measure<shared_array<const void>>("load_tuple", format, items, nbytes, min_time,
+                                                             [&]() { return load(as_tuple); }));
+            results.append(measure<py::object>("cast_array", format, items, nbytes, min_time,
+                                               [&]() { return py::cast(sa); }));
+        }
+
+        // strings always go through load_from_python_seq<std::string>
+        py::list str_list;
+        for (size_t i = 0; i < items; i++)
+            str_list.append(py::str("aiopvxs!"));
+        size_t nbytes = items * 8u;
+        auto sa = load(str_list);
+
+        results.append(measure<shared_array<const void>>("load_str_list", "str", items, nbytes, min_time,
+                                                         [&]() { return load(str_list); }));
+        results.append(measure<py::object>("cast_str_list", "str", items, nbytes, min_time,
+                                           [&]() { return py::cast(sa); }));
+    }
+    return results;
+}
+
+
+PYBIND11_MODULE(aiopvxs_bench, m) {
+    m.doc() = "Native timings of aiopvxs type casters (benchmark build only)";
+
+    m.def("heap_in_use", &heap_in_use, "Bytes allocated from the C heap, or -1 if unknown");
+    m.def("bench_casters", &bench_casters,
+          py::arg("sizes") = std::vector<size_t>{1, 1024, 1024 * 1024},
+          py::arg("formats") = std::vector<std::string>{"b", "B", "h", "H", "i", "I", "q", "Q", "f", "d"},
+          py::arg("min_time") = 0.2,
+          "Time shared_array type caster load and cast per array.array type code and "
+          "number of items, returns list of result dictionaries");
+}
@@ -18,6 +18,12 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
  */
 
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+
 #include <pybind11/pybind11.h>
 #include <pybind11/native_enum.h>
 #include <pybind11/functional.h>
@@ -25,80 +31,386 @@
 
 #include <pvxs/client.h>
 
+#include "metrics.hpp"
+
 namespace py = pybind11;
 
 /*
- * pvxs_result_handler
+ * CompletionQueue
  *
- * Returns a std::function<> that can be used as client Context
- * result handler. Assigns value or exception to the asyncio.Future
- * that represents the transaction in progress.
+ * Lock-free multi-producer, single-consumer queue that carries completed
+ * pvxs operations from pvxs worker threads to one asyncio event loop.
  *
- * The result is not directly assigned, rather a callback on the event
- * loop is scheduled to run very soon. This is the thread-safe way to
- * synchronize C++ events with Python asyncio events.
+ * Python objects (asyncio.Future or asyncio.Queue) waiting for completions
+ * are registered on the event loop with add(), which returns a token. pvxs
+ * worker threads push() a C++ callback for that token without acquiring the
+ * GIL. Only the first push() after the queue was drained acquires the GIL, to
+ * schedule a single drain() call on the event loop. drain() then runs every
+ * pending callback with the registered python object, in the order pushed.
  *
  */
-inline std::function<void(pvxs::client::Result&&)>
-pvxs_result_handler(py::object loop, py::object py_future) {
-    // lambda capture copies of asyncio event loop and Future
-    return [loop, py_future](pvxs::client::Result&& result) {
-        // GIL lock not automatically held in C++ callback, acquire GIL lock
-        py::gil_scoped_acquire lock;
-        try {
-            // test result for value or exception
-            pvxs::Value value = result();
-            // if value, schedule asyncio.Future.set_result(value)
-            // call on the event loop
-            loop.attr("call_soon_threadsafe")(
-                // GIL lock is held by default when py::cpp_function
-                // eventually executes
-                py::cpp_function([py_future, value]() {
-                    py_future.attr("set_result")(value);
-                })
-            );
+class CompletionQueue {
+public:
+    // runs in drain() with GIL held, returns true when target is done
+    typedef std::function<bool(py::handle)> completion_t;
+
+    /*
+     * Registration
+     *
+     * Keeps a python object registered with the CompletionQueue until the
+     * last reference to the Registration is released (GIL must be held).
+     *
+     */
+    struct Registration {
+        Registration(std::shared_ptr<CompletionQueue> queue, uint64_t token)
+            : queue(queue), token(token) {}
+        ~Registration() { queue->discard(token); }
+
+        const std::shared_ptr<CompletionQueue> queue;
+        const uint64_t token;
+    };
+
+    static std::shared_ptr<CompletionQueue>
+    build(py::object loop, std::shared_ptr<LatencyHistogram> gil_wait = nullptr) {
+        std::shared_ptr<CompletionQueue> queue(new CompletionQueue(loop));
+        // time pvxs worker threads wait for the GIL in push()
+        queue->gil_wait = gil_wait ? gil_wait : std::make_shared<LatencyHistogram>();
+        // drain() callback is created once, weak reference avoids a cycle
+        std::weak_ptr<CompletionQueue> weak_queue(queue);
+        queue->drain_cb = py::cpp_function([weak_queue]() {
+            if (auto queue = weak_queue.lock())
+                queue->drain();
+        });
+        return queue;
+    }
+
+    ~CompletionQueue() {
+        // callbacks that never reached the event loop only hold C++ objects
+        delete_nodes(head.exchange(nullptr));
+
+        // last reference might be released on a pvxs worker thread
+        if (!Py_IsInitialized()) {
+            for (auto& target : targets)
+                target.second.release();
+            drain_cb.release();
+            loop.release();
+            return;
         }
-        // if exception, schedule asyncio.Future.set_exception(py_exc)
-        // call on the event loop
-        catch (const py::key_error& e) {
-            py::object py_exc = py::module_::import("builtins").attr("KeyError")(e.what());
+        py::gil_scoped_acquire lock;
+        targets.clear();
+        drain_cb = py::object();
+        loop = py::object();
+    }
 
-            loop.attr("call_soon_threadsafe")(
-                py::cpp_function([py_future, py_exc]() {
-                    py_future.attr("set_exception")(py_exc);
-                })
-            );
+    const py::object& event_loop() const { return loop; }
+
+    // register python object, GIL must be held
+    uint64_t add(py::object target) {
+        uint64_t token = next_token++;
+        targets.emplace(token, std::move(target));
+        return token;
+    }
+
+    // register python object for as long as the returned Registration lives
+    static std::shared_ptr<Registration>
+    subscribe(std::shared_ptr<CompletionQueue> queue, py::object target) {
+        return std::make_shared<Registration>(queue, queue->add(target));
+    }
+
+    // unregister python object, GIL must be held
+    void discard(uint64_t token) { targets.erase(token); }
+
+    // queue callback for registered python object, safe without GIL
+    void push(uint64_t token, completion_t&& fn) {
+        Node* node = new Node(token, std::move(fn));
+
+        // push onto stack of pending callbacks
+        node->next = head.load();
+        while (!head.compare_exchange_weak(node->next, node)) {}
+
+        // schedule drain() on the event loop, unless already scheduled
+        if (!scheduled.exchange(true)) {
+            timed_gil_acquire lock(*gil_wait);
+            try {
+                loop.attr("call_soon_threadsafe")(drain_cb);
+            }
+            catch (py::error_already_set& e) {
+                // event loop is closed, nothing will ever be delivered. Drop
+                // pending callbacks with GIL held and re-arm, so later pushes
+                // are dropped the same way instead of piling up
+                e.discard_as_unraisable("CompletionQueue::push");
+                scheduled.store(false);
+                delete_nodes(head.exchange(nullptr));
+            }
         }
-        catch (const py::type_error& e) {
-            py::object py_exc = py::module_::import("builtins").attr("TypeError")(e.what());
+    }
 
-            loop.attr("call_soon_threadsafe")(
-                py::cpp_function([py_future, py_exc]() {
-                    py_future.attr("set_exception")(py_exc);
-                })
-            );
+    // run all pending callbacks, called on the event loop with GIL held
+    void drain() {
+        // re-arm first, anything pushed from here on schedules another drain()
+        scheduled.store(false);
+
+        // take stack of pending callbacks and reverse it into push order
+        Node* pending = nullptr;
+        Node* node = head.exchange(nullptr);
+        while (node) {
+            Node* next = node->next;
+            node->next = pending;
+            pending = node;
+            node = next;
         }
-        catch (const py::value_error& e) {
-            py::object py_exc = py::module_::import("builtins").attr("ValueError")(e.what());
 
-            loop.attr("call_soon_threadsafe")(
-                py::cpp_function([py_future, py_exc]() {
-                    py_future.attr("set_exception")(py_exc);
-                })
-            );
+        while (pending) {
+            std::unique_ptr<Node> current(pending);
+            pending = pending->next;
+
+            auto it = targets.find(current->token);
+            // target already discarded, ie. asyncio.Future was cancelled
+            if (it == targets.end())
+                continue;
+
+            py::object target = it->second;
+            try {
+                if (current->fn(target))
+                    targets.erase(current->token);
+            }
+            catch (py::error_already_set& e) {
+                e.discard_as_unraisable("CompletionQueue::drain");
+            }
+            catch (const std::exception& exc) {
+                py::print("C++ exception thrown in completion callback:", exc.what());
+            }
         }
-        catch (const std::exception& e) {
-            py::object py_exc = py::module_::import("builtins").attr("RuntimeError")(e.what());
+    }
 
-            loop.attr("call_soon_threadsafe")(
-                py::cpp_function([py_future, py_exc]() {
-                    py_future.attr("set_exception")(py_exc);
-                })
-            );
+private:
+    struct Node {
+        Node(uint64_t token, completion_t&& fn)
+            : token(token), fn(std::move(fn)), next(nullptr) {}
+
+        uint64_t token;
+        completion_t fn;
+        Node* next;
+    };
+
+    explicit CompletionQueue(py::object loop)
+        : loop(loop), next_token(0), head(nullptr), scheduled(false) {}
+
+    static void delete_nodes(Node* node) {
+        while (node) {
+            std::unique_ptr<Node> current(node);
+            node = node->next;
         }
+    }
+
+    // only used on the event loop with GIL held
+    py::object loop;
+    py::object drain_cb;
+    std::unordered_map<uint64_t, py::object> targets;
+    uint64_t next_token;
+
+    // shared with pvxs worker threads
+    std::atomic<Node*> head;
+    std::atomic<bool> scheduled;
+    std::shared_ptr<LatencyHistogram> gil_wait;
+};
+
+/*
+ * ClientStats
+ *
+ * Runtime metrics of a Context, returned by Context.stats(). Updated without
+ * a lock from the event loop and from pvxs worker threads.
+ *
+ */
+struct ClientStats {
+    ClientStats()
+        : subscriptions(0), monitor_events(0), monitor_updates(0), monitor_dropped(0),
+          monitor_squashed(0), monitor_queue_max(0) {}
+
+    // highest number of updates seen waiting in an asyncio.Queue
+    void queue_depth(uint64_t depth) {
+        uint64_t previous = monitor_queue_max.load(std::memory_order_relaxed);
+        while (depth > previous && !monitor_queue_max.compare_exchange_weak(previous, depth)) {}
+    }
+
+    py::dict to_python() const {
+        py::dict py_monitor;
+        py_monitor["subscriptions"] = subscriptions.load(std::memory_order_relaxed);
+        py_monitor["events"] = monitor_events.load(std::memory_order_relaxed);
+        py_monitor["updates"] = monitor_updates.load(std::memory_order_relaxed);
+        py_monitor["dropped"] = monitor_dropped.load(std::memory_order_relaxed);
+        py_monitor["squashed"] = monitor_squashed.load(std::memory_order_relaxed);
+        py_monitor["queue_max"] = monitor_queue_max.load(std::memory_order_relaxed);
+
+        py::dict py_stats;
+        py_stats["get"] = get.to_python();
+        py_stats["put"] = put.to_python();
+        py_stats["rpc"] = rpc.to_python();
+        py_stats["monitor"] = py_monitor;
+        py_stats["gil_wait"] = gil_wait.to_python();
+        return py_stats;
+    }
+
+    std::string prometheus(const std::string& prefix) const {
+        std::ostringstream out;
+        prometheus_ops(out, prefix, {{"get", &get}, {"put", &put}, {"rpc", &rpc}});
+        prometheus_metric(out, prefix + "_monitor_subscriptions_total", "counter",
+                          subscriptions.load(std::memory_order_relaxed));
+        prometheus_metric(out, prefix + "_monitor_events_total", "counter",
+                          monitor_events.load(std::memory_order_relaxed));
+        prometheus_metric(out, prefix + "_monitor_updates_total", "counter",
+                          monitor_updates.load(std::memory_order_relaxed));
+        prometheus_metric(out, prefix + "_monitor_dropped_total", "counter",
+                          monitor_dropped.load(std::memory_order_relaxed));
+        prometheus_metric(out, prefix + "_monitor_squashed_total", "counter",
+                          monitor_squashed.load(std::memory_order_relaxed));
+        prometheus_metric(out, prefix + "_monitor_queue_max", "gauge",
+                          monitor_queue_max.load(std::memory_order_relaxed));
+        out << "# TYPE " << prefix << "_gil_wait_seconds histogram\n";
+        gil_wait.prometheus(out, prefix + "_gil_wait_seconds", "");
+        return out.str();
+    }
+
+    void reset() {
+        get.reset();
+        put.reset();
+        rpc.reset();
+        subscriptions.store(0, std::memory_order_relaxed);
+        monitor_events.store(0, std::memory_order_relaxed);
+        monitor_updates.store(0, std::memory_order_relaxed);
+        monitor_dropped.store(0, std::memory_order_relaxed);
+        monitor_squashed.store(0, std::memory_order_relaxed);
+        monitor_queue_max.store(0, std::memory_order_relaxed);
+        gil_wait.reset();
+    }
+
+    // get, get_many; put, put_many; rpc, list
+    OpCounters get, put, rpc;
+
+    std::atomic<uint64_t> subscriptions;
+    // monitor .event() callbacks, updates delivered to python, updates
+    // dropped by OverflowEnum.DropOldest and overwritten with conflate=True
+    std::atomic<uint64_t> monitor_events;
+    std::atomic<uint64_t> monitor_updates;
+    std::atomic<uint64_t> monitor_dropped;
+    std::atomic<uint64_t> monitor_squashed;
+    std::atomic<uint64_t> monitor_queue_max;
+
+    // time pvxs worker threads waited for the GIL
+    LatencyHistogram gil_wait;
+};
+
+/*
+ * pvxs_result_unwrap
+ *
+ * Tests the result of an operation for value or exception. Returns the
+ * Value, or the python exception to be raised in its place. Must be
+ * called with GIL held.
+ *
+ */
+inline py::object
+pvxs_result_unwrap(pvxs::client::Result& result, bool& is_error) {
+    py::module_ builtins = py::module_::import("builtins");
+
+    is_error = true;
+    try {
+        // test result for value or exception
+        pvxs::Value value = result();
+        is_error = false;
+        return py::cast(value);
+    }
+    catch (const py::key_error& e) {
+        return builtins.attr("KeyError")(e.what());
+    }
+    catch (const py::type_error& e) {
+        return builtins.attr("TypeError")(e.what());
+    }
+    catch (const py::value_error& e) {
+        return builtins.attr("ValueError")(e.what());
+    }
+    catch (const std::exception& e) {
+        return builtins.attr("RuntimeError")(e.what());
+    }
+}
+
+/*
+ * pvxs_result_handler
+ *
+ * Returns a std::function<> that can be used as client Context
+ * result handler. Assigns value or exception to the asyncio.Future
+ * that represents the transaction in progress.
+ *
+ * The result is not directly assigned, rather it is pushed onto the
+ * CompletionQueue of the event loop without acquiring the GIL. The
+ * asyncio.Future is resolved when the event loop drains the queue.
+ * This is the thread-safe way to synchronize C++ events with Python
+ * asyncio events.
+ *
+ */
+inline std::function<void(pvxs::client::Result&&)>
+pvxs_result_handler(std::shared_ptr<CompletionQueue> queue, uint64_t token,
+                    std::shared_ptr<OpCounters> counters) {
+    // lambda capture copies of CompletionQueue and asyncio.Future token
+    return [queue, token, counters](pvxs::client::Result&& result) {
+        // GIL lock is held by default when the CompletionQueue is drained
+        queue->push(token, [result, counters](py::handle py_future) mutable {
+            bool is_error;
+            py::object py_result = pvxs_result_unwrap(result, is_error);
+            if (is_error)
+                counters->fail();
+
+            // asyncio.Future might have been cancelled already
+            if (py_future.attr("done")().cast<bool>())
+                return true;
+            else if (is_error)
+                py_future.attr("set_exception")(py_result);
+            else
+                py_future.attr("set_result")(py_result);
+            return true;
+        });
+    };
+}
+
+/*
+ * pvxs_gather_handler
+ *
+ * Returns a std::function<> that can be used as client Context result
+ * handler for one of several operations started together. The registered
+ * target is a tuple of (asyncio.Future, list). The value or exception of
+ * each operation is stored in the list at the index of that operation, and
+ * the asyncio.Future is resolved with the list once all have completed.
+ *
+ */
+inline std::function<void(pvxs::client::Result&&)>
+pvxs_gather_handler(std::shared_ptr<CompletionQueue> queue, uint64_t token,
+                    size_t index, std::shared_ptr<size_t> remaining,
+                    std::shared_ptr<OpCounters> counters) {
+    // remaining count is only touched when the CompletionQueue is drained
+    return [queue, token, index, remaining, counters](pvxs::client::Result&& result) {
+        queue->push(token, [result, index, remaining, counters](py::handle target) mutable {
+            bool is_error;
+            py::object py_result = pvxs_result_unwrap(result, is_error);
+            if (is_error)
+                counters->fail();
+
+            // exceptions are reported in place of the value
+            py::tuple gather = py::reinterpret_borrow<py::tuple>(target);
+            py::object py_future = gather[0];
+            py::list py_results = gather[1].cast<py::list>();
+            py_results[index] = py_result;
+
+            if (--(*remaining) > 0)
+                return false;
+            // asyncio.Future might have been cancelled already
+            if (!py_future.attr("done")().cast<bool>())
+                py_future.attr("set_result")(py_results);
+            return true;
+        });
     };
 }
 
+class AsyncPut;
+
 /*
  * py_future_done_handler
  *
@@ -106,36 +418,491 @@ pvxs_result_handler(py::object loop, py::object py_future) {
  * done callback. By capturing value of pvxs::client::Operation here
  * in the returned lambda function, this done handler maintains a
  * reference to the Operation until after the Operation is complete.
+ * The asyncio.Future is also removed from the CompletionQueue, and the
+ * time from exec() until the asyncio.Future is done is counted.
  *
  */
 template <typename T>
 inline py::cpp_function
-py_future_done_handler(std::shared_ptr<T> op) {
+py_future_done_handler(std::shared_ptr<T> op, std::shared_ptr<CompletionQueue> queue,
+                       uint64_t token, std::shared_ptr<OpCounters> counters) {
    static_assert(std::is_same<T, pvxs::client::Operation>::value ||
-                 std::is_same<T, pvxs::client::Subscription>::value,
-                "Only Operation and Subscription are supported");
+                 std::is_same<T, pvxs::client::Subscription>::value ||
+                 std::is_same<T, AsyncPut>::value,
+                "Only Operation, Subscription and AsyncPut are supported");
 
+    auto started = counters->start();
     // the lambda capture here is keeping the operation alive while it runs
-    return py::cpp_function([op](py::object fut) {
+    return py::cpp_function([op, queue, token, counters, started](py::object fut) {
+        queue->discard(token);
         // if Future was cancelled, also call Operation::cancel()
-        if (fut.attr("cancelled")())
+        if (fut.attr("cancelled")().cast<bool>()) {
             op->cancel();
+            counters->cancel();
+        }
+        else {
+            counters->finish(started);
+        }
     });
 }
 
+/*
+ * py_future_done_handler
+ *
+ * Same as above, for an asyncio.Future that represents several operations.
+ *
+ */
+template <typename T>
+inline py::cpp_function
+py_future_done_handler(std::vector<std::shared_ptr<T>> ops, std::shared_ptr<CompletionQueue> queue,
+                       uint64_t token, std::shared_ptr<OpCounters> counters) {
+   static_assert(std::is_same<T, pvxs::client::Operation>::value ||
+                 std::is_same<T, AsyncPut>::value,
+                "Only Operation and AsyncPut are supported");
+
+    auto started = counters->start(ops.size());
+    // the lambda capture here is keeping the operations alive while they run
+    return py::cpp_function([ops, queue, token, counters, started](py::object fut) {
+        queue->discard(token);
+        // if Future was cancelled, also call Operation::cancel() on every operation
+        if (fut.attr("cancelled")().cast<bool>()) {
+            for (auto& op : ops)
+                op->cancel();
+            counters->cancel(ops.size());
+        }
+        else {
+            counters->finish(started, ops.size());
+        }
+    });
+}
+
+/*
+ * pvxs_request
+ *
+ * Applies python field names and pvRequest string to a Get/MonitorBuilder,
+ * so the server only sends the requested fields.
+ *
+ */
+template <typename Builder>
+inline Builder&
+pvxs_request(Builder& builder, const std::vector<std::string>& fields, const std::string& request) {
+    for (auto& field : fields)
+        builder.field(field);
+    if (!request.empty())
+        builder.pvRequest(request);
+    return builder;
+}
+
+/*
+ * PVTypeCache
+ *
+ * Remembers the Value type of each PV written with Context.put(), so later
+ * puts to the same PV can skip fetching the type of the PV first. A
+ * Connect operation watches each cached PV and marks its type stale when
+ * the PV disconnects, since the server might come back with another type.
+ *
+ * At most capacity PVs are cached. Writing a PV that is not cached evicts
+ * the least recently used one, with its Connect operation.
+ *
+ * Safe to use from pvxs worker threads, no GIL needed.
+ *
+ */
+class PVTypeCache {
+public:
+    explicit PVTypeCache(size_t capacity) : capacity(capacity > 0 ? capacity : 1) {}
+
+    // returns the cached type, or an empty Value if not cached or stale
+    pvxs::Value lookup(const std::string& pv_name) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(pv_name);
+        if (it == entries.end())
+            return pvxs::Value();
+        // most recently used PVs are at the front
+        recent.splice(recent.begin(), recent, it->second.position);
+        return it->second.prototype;
+    }
+
+    // only PVs being watched are cached
+    void store(const std::string& pv_name, const pvxs::Value& prototype) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(pv_name);
+        if (it != entries.end())
+            it->second.prototype = prototype.cloneEmpty();
+    }
+
+    void invalidate(const std::string& pv_name) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(pv_name);
+        if (it != entries.end())
+            it->second.prototype = pvxs::Value();
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> guard(lock);
+        return entries.size();
+    }
+
+    // start watching PV for disconnects, if not already. GIL must be held
+    static void watch(std::shared_ptr<PVTypeCache> cache,
+                      pvxs::client::Context& ctx, const std::string& pv_name) {
+        {
+            std::lock_guard<std::mutex> guard(cache->lock);
+            if (cache->entries.count(pv_name))
+                return;
+        }
+
+        // weak reference, the cache owns the watcher
+        std::weak_ptr<PVTypeCache> weak_cache(cache);
+        auto watcher = ctx.connect(pv_name)
+            .onDisconnect([weak_cache, pv_name]() {
+                if (auto cache = weak_cache.lock())
+                    cache->invalidate(pv_name);
+            })
+            .exec();
+
+        // evicted watchers are released after the lock, since their
+        // onDisconnect() callback takes it too
+        std::vector<std::shared_ptr<pvxs::client::Connect>> evicted;
+        {
+            std::lock_guard<std::mutex> guard(cache->lock);
+            if (cache->entries.count(pv_name))
+                return;
+
+            while (cache->entries.size() >= cache->capacity) {
+                auto oldest = cache->entries.find(cache->recent.back());
+                evicted.push_back(oldest->second.watcher);
+                cache->entries.erase(oldest);
+                cache->recent.pop_back();
+            }
+
+            cache->recent.push_front(pv_name);
+            auto& entry = cache->entries[pv_name];
+            entry.watcher = watcher;
+            entry.position = cache->recent.begin();
+        }
+
+        // cancelling a Connect waits for the pvxs worker, which might be
+        // waiting for the GIL to push a completion
+        if (!evicted.empty()) {
+            py::gil_scoped_release unlocked;
+            evicted.clear();
+        }
+    }
+
+private:
+    struct Entry {
+        pvxs::Value prototype;
+        std::shared_ptr<pvxs::client::Connect> watcher;
+        std::list<std::string>::iterator position;
+    };
+
+    const size_t capacity;
+    std::mutex lock;
+    std::unordered_map<std::string, Entry> entries;
+    // PV names, most recently used first
+    std::list<std::string> recent;
+};
+
+// defined in data.cpp
+void assign_dict(pvxs::Value& value, py::dict values_dict);
+py::object update_python(py::handle target, const pvxs::Value& value);
+
+/*
+ * pvxs_put_value
+ *
+ * Casts python new_data (a dictionary of field names and values) to a new
+ * Value with the type of prototype. Errors are raised as KeyError, TypeError
+ * or ValueError C++ exceptions, so they can be passed to the C++ result
+ * handler. Must be called with GIL held.
+ *
+ */
+inline pvxs::Value
+pvxs_put_value(const pvxs::Value& prototype, py::handle new_data) {
+    if (!py::isinstance<py::dict>(new_data))
+        throw py::type_error("Put data must be a dictionary of field names and values");
+
+    pvxs::Value toput(prototype.cloneEmpty());
+    try {
+        // recursively cast each key to its field
+        assign_dict(toput, py::reinterpret_borrow<py::dict>(new_data));
+    }
+    catch (py::error_already_set& e) {
+        // python exceptions can not be passed to the result handler
+        if (e.matches(PyExc_KeyError))
+            throw py::key_error(e.what());
+        else if (e.matches(PyExc_TypeError))
+            throw py::type_error(e.what());
+        else
+            throw py::value_error(e.what());
+    }
+    catch (const pvxs::NoField& e) {
+        throw py::key_error(e.what());
+    }
+    catch (const pvxs::LookupError& e) {
+        throw py::key_error(e.what());
+    }
+    catch (const pvxs::NoConvert& e) {
+        throw py::type_error(e.what());
+    }
+    return toput;
+}
+
+/*
+ * AsyncPut
+ *
+ * Put operation that casts python new_data to the Value type of the PV on
+ * the event loop, before the pvxs put operation is started, so pvxs worker
+ * threads never wait for the GIL to build the Value to be sent.
+ *
+ * The type of the PV comes from the PVTypeCache if there is one, otherwise
+ * from an info() operation that runs first. AsyncPut is only used on the
+ * event loop with GIL held.
+ *
+ */
+class AsyncPut {
+public:
+    typedef std::function<void(pvxs::client::Result&&)> result_t;
+
+    static std::shared_ptr<AsyncPut>
+    start(pvxs::client::Context& ctx, const std::string& pv_name, py::object new_data,
+          std::shared_ptr<PVTypeCache> type_cache,
+          std::shared_ptr<CompletionQueue> queue, uint64_t token, result_t&& on_result) {
+        std::shared_ptr<AsyncPut> put(new AsyncPut(ctx, pv_name, new_data, type_cache, std::move(on_result)));
+
+        pvxs::Value prototype;
+        if (type_cache) {
+            prototype = type_cache->lookup(pv_name);
+            if (!prototype)
+                PVTypeCache::watch(type_cache, ctx, pv_name);
+        }
+
+        if (prototype) {
+            put->send(prototype);
+            return put;
+        }
+
+        // type of the PV is not known yet, fetch it first. Weak reference,
+        // the asyncio.Future done callback owns the AsyncPut
+        std::weak_ptr<AsyncPut> weak_put(put);
+        put->op = ctx.info(pv_name)
+            .result([queue, token, weak_put](pvxs::client::Result&& result) {
+                queue->push(token, [result, weak_put](py::handle) mutable {
+                    if (auto put = weak_put.lock())
+                        put->received_type(result);
+                    // target is resolved by the put operation result
+                    return false;
+                });
+            })
+            .exec();
+        return put;
+    }
+
+    void cancel() {
+        if (op)
+            op->cancel();
+    }
+
+private:
+    AsyncPut(pvxs::client::Context& ctx, const std::string& pv_name, py::object new_data,
+             std::shared_ptr<PVTypeCache> type_cache, result_t&& on_result)
+        : ctx(ctx), pv_name(pv_name), new_data(new_data),
+          type_cache(type_cache), on_result(std::move(on_result)) {}
+
+    void received_type(pvxs::client::Result& result) {
+        pvxs::Value prototype;
+        try {
+            prototype = result();
+        }
+        catch (...) {
+            fail(std::current_exception());
+            return;
+        }
+
+        if (type_cache)
+            type_cache->store(pv_name, prototype);
+        send(prototype);
+    }
+
+    void send(const pvxs::Value& prototype) {
+        using pvxs::Value;
+
+        Value toput;
+        try {
+            toput = pvxs_put_value(prototype, new_data);
+        }
+        catch (...) {
+            fail(std::current_exception());
+            return;
+        }
+        // python data is not needed anymore
+        new_data = py::object();
+
+        auto type_cache = this->type_cache;
+        auto pv_name = this->pv_name;
+        op = ctx.put(pv_name)
+            .build([toput, type_cache, pv_name](Value&& current) {
+                // pure C++, the GIL is not needed here
+                if (type_cache)
+                    type_cache->store(pv_name, current);
+                if (current.equalType(toput))
+                    return toput;
+
+                // PV type changed since toput was built, copy fields by name
+                Value retyped(current.cloneEmpty());
+                retyped.assign(toput);
+                return retyped;
+            })
+            .result(result_t(on_result))
+            .exec();
+    }
+
+    void fail(std::exception_ptr err) {
+        new_data = py::object();
+        op.reset();
+        on_result(pvxs::client::Result(err));
+    }
+
+    pvxs::client::Context ctx;
+    std::string pv_name;
+    py::object new_data;
+    std::shared_ptr<PVTypeCache> type_cache;
+    result_t on_result;
+    // info() operation, then put() operation
+    std::shared_ptr<pvxs::client::Operation> op;
+};
+
+/*
+ * drain_subscription
+ *
+ * Pops every update currently waiting in the pvxs::client::Subscription
+ * queue and appends it (or the event it raised) to a python list. pvxs only
+ * calls the .event() callback again after pop() has returned an empty Value,
+ * so the queue must always be drained completely, unless the caller keeps
+ * track of having stopped at max_items (0 is no limit). Returns true if it
+ * stopped at max_items, ie. updates might still be waiting.
+ *
+ * GIL lock must be held by the caller.
+ *
+ */
+inline bool
+drain_subscription(pvxs::client::Subscription& sub, py::list& batch, size_t max_items = 0) {
+    using namespace pvxs::client;
+
+    size_t count = 0;
+    while (max_items == 0 || count < max_items) {
+        count++;
+        try {
+            auto val = sub.pop();
+            // queue is empty
+            if (!val)
+                return false;
+            batch.append(py::cast(val));
+        }
+        catch (const Finished& fin) {
+            // nothing more will arrive after Finished
+            batch.append(py::cast(fin));
+            return false;
+        }
+        catch (const Connected& con) { batch.append(py::cast(con)); }
+        catch (const Disconnect& dis) { batch.append(py::cast(dis)); }
+        catch (const RemoteError& rem) { batch.append(py::cast(rem)); }
+        catch (const std::exception& exc) {
+            py::print("C++ exception thrown in monitor callback:", exc.what());
+            batch.append(py::cast(exc));
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * MonitorOverflow
+ *
+ * What a subscription does when its asyncio.Queue is full.
+ *
+ */
+enum class MonitorOverflow {
+    DropOldest, // discard the oldest update in the asyncio.Queue
+    Coalesce,   // leave updates in the pvxs queue, which merges them
+    Block,      // leave updates in the pvxs queue, server waits (pipeline)
+};
+
+/*
+ * MonitorQueue
+ *
+ * Bookkeeping for moving updates from a pvxs::client::Subscription into a
+ * bounded asyncio.Queue. When the asyncio.Queue is full and the overflow
+ * policy keeps updates in the pvxs queue, the pvxs queue is left partly
+ * drained (stalled). pvxs will not call the .event() callback again, so
+ * fill() must be called again once the consumer has taken something.
+ *
+ * Only used on the event loop with GIL held.
+ *
+ */
+struct MonitorQueue {
+    MonitorQueue(size_t queue_size, MonitorOverflow overflow, std::shared_ptr<ClientStats> stats)
+        : queue_size(queue_size), overflow(overflow), stalled(false), dropped(0), stats(stats) {}
+
+    void fill(pvxs::client::Subscription& sub, py::handle py_queue) {
+        py::list batch;
+        size_t queued = py_queue.attr("qsize")().cast<size_t>();
+
+        if (queue_size == 0 || overflow == MonitorOverflow::DropOldest) {
+            // always drain completely
+            drain_subscription(sub, batch);
+            stalled = false;
+        }
+        else if (queued >= queue_size) {
+            // no room, leave it all in the pvxs queue
+            stalled = true;
+            return;
+        }
+        else {
+            stalled = drain_subscription(sub, batch, queue_size - queued);
+        }
+
+        // put new data into python queue, unblocks any waiting q.get() calls
+        py::object put_nowait = py_queue.attr("put_nowait");
+        for (auto val : batch) {
+            if (queue_size > 0 && queued >= queue_size) {
+                py_queue.attr("get_nowait")();
+                dropped++;
+                stats->monitor_dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+            else {
+                queued++;
+            }
+            put_nowait(val);
+        }
+        stats->monitor_updates.fetch_add(batch.size(), std::memory_order_relaxed);
+        stats->queue_depth(queued);
+    }
+
+    const size_t queue_size;
+    const MonitorOverflow overflow;
+    bool stalled;
+    uint64_t dropped;
+    std::shared_ptr<ClientStats> stats;
+};
+
 /*
  * AsyncSubscription
  *
  * Class that pairs a pvxs::client::Subscription with an asyncio.Queue. Allows
  * calling same methods as a Subscription, but with additional methods to await
- * on asyncio.Queue.get() to suspend execution until new data is ready.
+ * on asyncio.Queue.get() to suspend execution until new data is ready. The
+ * asyncio.Queue stays registered with the CompletionQueue while any copy of
+ * the AsyncSubscription exists.
  *
  */
 class AsyncSubscription {
 public:
     AsyncSubscription(std::shared_ptr<pvxs::client::Subscription> sub,
-                      py::object py_queue)
-        : sub(sub), py_queue(py_queue) {}
+                      std::shared_ptr<CompletionQueue::Registration> registration,
+                      py::object loop, py::object py_queue,
+                      std::shared_ptr<MonitorQueue> queue_state)
+        : sub(sub), registration(registration), loop(loop), py_queue(py_queue),
+          queue_state(queue_state) {}
 
     //~AsyncSubscription() { sub->cancel(); }
 
@@ -146,42 +913,327 @@ public:
     const std::string name() { return sub->name(); }
 
     py::object pop() {
-        py::object val;
+        // the monitor event callback drains the pvxs queue into the asyncio.Queue,
+        // return asyncio.Queue.get() co-routine
+        refill();
+        return py_queue.attr("get")();
+    }
 
-        try {
-            auto val = sub->pop();
-            if (val)
-                py_queue.attr("put_nowait")(py::cast(val));
-        }
-        catch (const pvxs::client::Finished& fin) {
-            py_queue.attr("put_nowait")(py::cast(fin));
+    py::object get() {
+        // return asyncio.Queue.get() co-routine
+        return this->pop();
+    }
+
+    py::object pop_batch(size_t max_items) {
+        // the result of this method is an asyncio.Future that resolves to a list
+        // with every update waiting in the queue (at most max_items, 0 is no limit)
+        py::object py_future = loop.attr("create_future")();
+        refill();
+
+        // updates already waiting, no need to suspend
+        if (!py_queue.attr("empty")().cast<bool>()) {
+            py::list batch;
+            take_batch(py_queue, max_items, batch);
+            py_future.attr("set_result")(batch);
+            return py_future;
         }
-        catch (const pvxs::client::Connected& con) {
-            py_queue.attr("put_nowait")(py::cast(con));
+
+        // otherwise wait for the first update with asyncio.Queue.get(), then
+        // collect whatever else arrived along with it
+        py::object getter = loop.attr("create_task")(py_queue.attr("get")());
+        py::object queue = py_queue;
+        getter.attr("add_done_callback")(py::cpp_function([py_future, queue, max_items](py::object task) {
+            if (task.attr("cancelled")().cast<bool>() || py_future.attr("done")().cast<bool>())
+                return;
+
+            py::list batch;
+            batch.append(task.attr("result")());
+            take_batch(queue, max_items, batch);
+            py_future.attr("set_result")(batch);
+        }));
+        // if the asyncio.Future is cancelled, stop waiting on asyncio.Queue.get()
+        py_future.attr("add_done_callback")(py::cpp_function([getter](py::object fut) {
+            if (fut.attr("cancelled")().cast<bool>())
+                getter.attr("cancel")();
+        }));
+
+        return py_future;
+    }
+
+    py::dict stats(bool reset) {
+        pvxs::client::SubscriptionStat stat;
+        sub->stats(stat, reset);
+
+        py::dict py_stats;
+        py_stats["queued"] = py_queue.attr("qsize")();
+        py_stats["dropped"] = queue_state->dropped;
+        py_stats["nQueue"] = stat.nQueue;
+        py_stats["nSrvSquash"] = stat.nSrvSquash;
+        py_stats["nCliSquash"] = stat.nCliSquash;
+        py_stats["maxQueue"] = stat.maxQueue;
+        py_stats["limitQueue"] = stat.limitQueue;
+        if (reset)
+            queue_state->dropped = 0;
+        return py_stats;
+    }
+
+private:
+    // pvxs queue was left partly drained because asyncio.Queue was full
+    void refill() {
+        if (queue_state->stalled)
+            queue_state->fill(*sub, py_queue);
+    }
+
+    // move items from asyncio.Queue into batch until empty or batch has max_items
+    static void take_batch(py::object queue, size_t max_items, py::list& batch) {
+        py::object get_nowait = queue.attr("get_nowait");
+        py::object empty = queue.attr("empty");
+
+        while ((max_items == 0 || batch.size() < max_items) && !empty().cast<bool>())
+            batch.append(get_nowait());
+    }
+
+    std::shared_ptr<pvxs::client::Subscription> sub;
+    std::shared_ptr<CompletionQueue::Registration> registration;
+    py::object loop;
+    py::object py_queue;
+    std::shared_ptr<MonitorQueue> queue_state;
+};
+
+/*
+ * AsyncSubscriptionBatches
+ *
+ * Async iterator returned by Subscription.batches(). Each iteration returns
+ * a list with all updates that arrived since the previous iteration.
+ *
+ */
+class AsyncSubscriptionBatches {
+public:
+    AsyncSubscriptionBatches(const AsyncSubscription& sub, size_t max_items)
+        : sub(sub), max_items(max_items) {}
+
+    py::object pop() {
+        // return asyncio.Future that resolves to list of updates
+        return sub.pop_batch(max_items);
+    }
+
+private:
+    AsyncSubscription sub;
+    size_t max_items;
+};
+
+/*
+ * LatestSlot
+ *
+ * Holds only the latest update (Value or event) of a subscription, in place
+ * of a queue. The pvxs queue is drained into the slot on the pvxs worker
+ * thread without the GIL, so the event loop only needs to be woken up once
+ * until the consumer takes the slot, however fast updates arrive.
+ *
+ */
+struct LatestSlot {
+    LatestSlot(std::shared_ptr<ClientStats> stats, bool merge = false)
+        : merge(merge), stats(stats), full(false), overwritten(false), notified(false),
+          last_overwritten(false) {}
+
+    // called on pvxs worker thread, returns true if event loop must be woken up
+    bool fill(pvxs::client::Subscription& sub) {
+        using namespace pvxs::client;
+
+        bool more = true;
+        while (more) {
+            pvxs::Value val;
+            std::exception_ptr evt;
+            try {
+                val = sub.pop();
+                // queue is empty
+                if (!val)
+                    break;
+            }
+            catch (const Connected&) { evt = std::current_exception(); }
+            catch (const Disconnect&) { evt = std::current_exception(); }
+            catch (const RemoteError&) { evt = std::current_exception(); }
+            catch (...) {
+                // nothing more will arrive after Finished
+                evt = std::current_exception();
+                more = false;
+            }
+
+            std::lock_guard<std::mutex> guard(lock);
+            if (full)
+                stats->monitor_squashed.fetch_add(1, std::memory_order_relaxed);
+            overwritten = overwritten || full;
+            if (merge && value && val)
+                // keep the fields marked by the update that is overwritten
+                value.assign(val);
+            else
+                value = std::move(val);
+            event = evt;
+            full = true;
         }
-        catch (const pvxs::client::Disconnect& dis) {
-            py_queue.attr("put_nowait")(py::cast(dis));
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (!full || notified)
+            return false;
+        notified = true;
+        return true;
+    }
+
+    // called on event loop with GIL held, returns false if slot is empty.
+    // A Value update is copied into target in place, if there is one
+    bool take(py::object& update, py::handle target = py::handle()) {
+        pvxs::Value val;
+        std::exception_ptr evt;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            notified = false;
+            if (!full)
+                return false;
+            val = std::move(value);
+            evt = event;
+            last_overwritten = overwritten;
+            stats->monitor_updates.fetch_add(1, std::memory_order_relaxed);
+            value = pvxs::Value();
+            event = nullptr;
+            full = false;
+            overwritten = false;
         }
-        catch (const pvxs::client::RemoteError& err) {
-            py_queue.attr("put_nowait")(py::cast(err));
+
+        if (evt)
+            update = subscription_event(evt);
+        else if (target && !target.is_none())
+            update = update_python(target, val);
+        else
+            update = py::cast(val);
+        return true;
+    }
+
+    // convert event raised by Subscription::pop() to python object
+    static py::object subscription_event(const std::exception_ptr& evt) {
+        using namespace pvxs::client;
+
+        try {
+            std::rethrow_exception(evt);
         }
+        catch (const Finished& fin) { return py::cast(fin); }
+        catch (const Connected& con) { return py::cast(con); }
+        catch (const Disconnect& dis) { return py::cast(dis); }
+        catch (const RemoteError& rem) { return py::cast(rem); }
         catch (const std::exception& exc) {
-            py::print("C++ exception thrown in monitor callback:", exc.what());
-            py_queue.attr("put_nowait")(py::cast(exc));
+            return py::module_::import("builtins").attr("RuntimeError")(exc.what());
         }
+    }
 
-        // return asyncio.Queue.get() co-routine
-        return py_queue.attr("get")();
+    // updates that overwrite each other are merged, so that no marked
+    // field is lost when only marked fields are copied by take()
+    const bool merge;
+    const std::shared_ptr<ClientStats> stats;
+
+    // shared with pvxs worker threads
+    std::mutex lock;
+    pvxs::Value value;
+    std::exception_ptr event;
+    bool full;
+    bool overwritten;
+    bool notified;
+
+    // only used on the event loop, whether the last update taken had
+    // overwritten other updates that were never taken
+    bool last_overwritten;
+};
+
+/*
+ * AsyncLatestSubscription
+ *
+ * Class that pairs a pvxs::client::Subscription with a LatestSlot, returned
+ * by Context.monitor(conflate=True). pop() returns an asyncio.Future that
+ * resolves to the latest update, as soon as there is one. The registered
+ * python object is a list holding the asyncio.Future that is waiting, if any,
+ * and the target object that updates are copied into (or None).
+ *
+ */
+class AsyncLatestSubscription {
+public:
+    AsyncLatestSubscription(std::shared_ptr<pvxs::client::Subscription> sub,
+                            std::shared_ptr<CompletionQueue::Registration> registration,
+                            py::object loop, py::list waiter, std::shared_ptr<LatestSlot> slot)
+        : sub(sub), registration(registration), loop(loop), waiter(waiter), slot(slot) {}
+
+    bool cancel() { return sub->cancel(); }
+    void pause()  { return sub->pause(true); }
+    void resume() { return sub->pause(false); }
+
+    const std::string name() { return sub->name(); }
+
+    py::object pop() {
+        // an asyncio.Future is already waiting for the next update
+        py::object py_future = waiter[0];
+        if (!py_future.is_none() && !py_future.attr("done")().cast<bool>())
+            return py_future;
+
+        py_future = loop.attr("create_future")();
+        py::object update;
+        if (slot->take(update, waiter[1])) {
+            py_future.attr("set_result")(update);
+            waiter[0] = py::none();
+        }
+        else {
+            // resolved by monitor event callback, see resolve()
+            waiter[0] = py_future;
+        }
+        return py_future;
     }
 
     py::object get() {
-        // return asyncio.Queue.get() co-routine
+        // alias for pop()
         return this->pop();
     }
 
+    py::object latest() {
+        // latest update if there is one, without waiting
+        py::object update = py::none();
+        slot->take(update, waiter[1]);
+        return update;
+    }
+
+    bool overwritten() const { return slot->last_overwritten; }
+
+    // called on event loop when the CompletionQueue is drained
+    static void resolve(LatestSlot& slot, py::handle waiter_handle) {
+        py::list waiter = py::reinterpret_borrow<py::list>(waiter_handle);
+        py::object py_future = waiter[0];
+        // nobody waiting, leave update in slot for the next pop()
+        if (py_future.is_none() || py_future.attr("done")().cast<bool>())
+            return;
+
+        py::object update;
+        try {
+            if (!slot.take(update, waiter[1]))
+                return;
+        }
+        catch (py::builtin_exception& exc) {
+            // update could not be copied into target, eg. wrong buffer size
+            exc.set_error();
+            py::error_already_set err;
+            waiter[0] = py::none();
+            py_future.attr("set_exception")(err.value());
+            return;
+        }
+        catch (py::error_already_set& err) {
+            waiter[0] = py::none();
+            py_future.attr("set_exception")(err.value());
+            return;
+        }
+        waiter[0] = py::none();
+        py_future.attr("set_result")(update);
+    }
+
 private:
     std::shared_ptr<pvxs::client::Subscription> sub;
-    py::object py_queue;
+    std::shared_ptr<CompletionQueue::Registration> registration;
+    py::object loop;
+    py::list waiter;
+    std::shared_ptr<LatestSlot> slot;
 };
 
 /*
@@ -195,8 +1247,9 @@ private:
 class AsyncDiscover {
 public:
     AsyncDiscover(std::shared_ptr<pvxs::client::Operation> sub,
+                  std::shared_ptr<CompletionQueue::Registration> registration,
                   py::object py_queue)
-        : sub(sub), py_queue(py_queue) {}
+        : sub(sub), registration(registration), py_queue(py_queue) {}
 
     //~AsyncSubscription() { sub->cancel(); }
 
@@ -216,9 +1269,50 @@ public:
 
 private:
     std::shared_ptr<pvxs::client::Operation> sub;
+    std::shared_ptr<CompletionQueue::Registration> registration;
     py::object py_queue;
 };
 
+/*
+ * AsyncContext
+ *
+ * Class that extends a pvxs::client::Context with the CompletionQueue used
+ * to deliver results to the asyncio event loop. A new CompletionQueue is
+ * created whenever the Context is used from a different event loop.
+ *
+ */
+class AsyncContext : public pvxs::client::Context {
+public:
+    explicit AsyncContext(pvxs::client::Context&& ctx, bool use_type_cache = false,
+                          size_t type_cache_size = 1024)
+        : pvxs::client::Context(std::move(ctx)),
+          type_cache(use_type_cache ? std::make_shared<PVTypeCache>(type_cache_size) : nullptr),
+          stats(std::make_shared<ClientStats>()) {}
+
+    std::shared_ptr<CompletionQueue> completions() {
+        py::object loop = py::module_::import("asyncio").attr("get_event_loop")();
+
+        // operations still in progress keep a reference to the previous queue
+        if (!queue || !queue->event_loop().is(loop))
+            queue = CompletionQueue::build(loop, std::shared_ptr<LatencyHistogram>(stats, &stats->gil_wait));
+        return queue;
+    }
+
+    // runtime metrics, and the counters of each kind of operation
+    std::shared_ptr<ClientStats> metrics() const { return stats; }
+    std::shared_ptr<OpCounters> counters(OpCounters ClientStats::*member) const {
+        return std::shared_ptr<OpCounters>(stats, &(stats.get()->*member));
+    }
+
+    // PV type cache used by put(), nullptr if disabled
+    std::shared_ptr<PVTypeCache> types() const { return type_cache; }
+
+private:
+    std::shared_ptr<CompletionQueue> queue;
+    std::shared_ptr<PVTypeCache> type_cache;
+    std::shared_ptr<ClientStats> stats;
+};
+
 
 void create_submodule_client(py::module_& m) {
     m.doc() = "PVAccess Client API";
@@ -245,6 +1339,12 @@ void create_submodule_client(py::module_& m) {
         .value("Timeout", Discovered::event_t::Timeout)
         .finalize();
 
+    py::native_enum<MonitorOverflow>(m, "OverflowEnum", "enum.Enum")
+        .value("DropOldest", MonitorOverflow::DropOldest)
+        .value("Coalesce", MonitorOverflow::Coalesce)
+        .value("Block", MonitorOverflow::Block)
+        .finalize();
+
     py::class_<Discovered>(m, "Discovered", "")
         .def_readonly("event", &Discovered::event)
         .def_readonly("peerVersion", &Discovered::peerVersion)
@@ -263,6 +1363,14 @@ void create_submodule_client(py::module_& m) {
         .def("cancel", &AsyncSubscription::cancel, "Cancels an active event subscription")
         .def("pop", &AsyncSubscription::pop, "Get updated Value from subscription queue")
         .def("get", &AsyncSubscription::get, "Get updated Value from subscription queue (alias for pop())")
+        .def("pop_batch", &AsyncSubscription::pop_batch, py::arg("max") = 0,
+                          "Get list of all updated Values waiting in subscription queue (max=0 is no limit)")
+        .def("stats", &AsyncSubscription::stats, py::arg("reset") = false,
+                      "Returns dictionary of subscription queue statistics, including the number "
+                      "of updates dropped by the OverflowEnum.DropOldest policy")
+        .def("batches", [](const AsyncSubscription& self, size_t max_items) {
+            return AsyncSubscriptionBatches(self, max_items);
+        }, py::arg("max") = 0, "Iterate over lists of updated Values with an async for loop (max=0 is no limit)")
         // implement iterator protocol
         .def("__aiter__", [](const AsyncSubscription& self) { return self; })
         .def("__anext__", [](AsyncSubscription& self) {
@@ -274,6 +1382,23 @@ void create_submodule_client(py::module_& m) {
             return val;
         });
 
+    py::class_<AsyncLatestSubscription, py::smart_holder>(m, "LatestSubscription", "Represents the active event subscription that only keeps the latest update")
+        .def("name", &AsyncLatestSubscription::name, "Operation name")
+        .def("cancel", &AsyncLatestSubscription::cancel, "Cancels an active event subscription")
+        .def("pop", &AsyncLatestSubscription::pop, "Get latest updated Value, waiting for one if there is none")
+        .def("get", &AsyncLatestSubscription::get, "Get latest updated Value (alias for pop())")
+        .def("latest", &AsyncLatestSubscription::latest, "Get latest updated Value without waiting, or None")
+        .def_property_readonly("overwritten", &AsyncLatestSubscription::overwritten,
+                               "True if the last Value returned replaced updates that were never returned")
+        // implement iterator protocol
+        .def("__aiter__", [](const AsyncLatestSubscription& self) { return self; })
+        .def("__anext__", &AsyncLatestSubscription::pop);
+
+    py::class_<AsyncSubscriptionBatches, py::smart_holder>(m, "SubscriptionBatches", "Iterates over batches of updates from an active event subscription")
+        // implement iterator protocol
+        .def("__aiter__", [](const AsyncSubscriptionBatches& self) { return self; })
+        .def("__anext__", &AsyncSubscriptionBatches::pop);
+
     py::class_<AsyncDiscover, py::smart_holder>(m, "Discover", "Represents the active discover operation")
         .def("name", &AsyncDiscover::name, "Operation name")
         .def("cancel", &AsyncDiscover::cancel, "Cancels an active event subscription")
@@ -290,89 +1415,156 @@ void create_submodule_client(py::module_& m) {
             return val;
         });
 
-    py::class_<Context>(m, "Context", "PVAccess protocol client")
-        .def(py::init(&Context::fromEnv), "Initialise a Context with settings from Config::fromEnv()")
-        .def("close", &Context::close, "Disconnects any active clients and closes network connection")
+    py::class_<AsyncContext>(m, "Context", "PVAccess protocol client")
+        .def(py::init([](bool type_cache, size_t type_cache_size) {
+            return AsyncContext(Context::fromEnv(), type_cache, type_cache_size);
+        }), py::arg("type_cache") = false, py::arg("type_cache_size") = 1024,
+            "Initialise a Context with settings from Config::fromEnv(). With type_cache=True, "
+            "put() remembers the type of each PV until it disconnects, instead of fetching "
+            "the type before every put. At most type_cache_size PVs are remembered, the least "
+            "recently used is forgotten first")
+        .def("close", &AsyncContext::close, py::call_guard<py::gil_scoped_release>(),
+                      "Disconnects any active clients and closes network connection")
+        .def("stats", [](AsyncContext& self, bool reset) {
+            auto stats = self.metrics();
+            py::dict py_stats = stats->to_python();
+            if (reset)
+                stats->reset();
+            return py_stats;
+        }, py::arg("reset") = false,
+           "Returns dictionary of runtime metrics: get/put/rpc operations issued, completed, "
+           "failed, cancelled and in flight with latency histograms, monitor updates, drops "
+           "and queue depth, and the time pvxs threads waited for the GIL")
+        .def("prometheus", [](AsyncContext& self, const std::string& prefix) {
+            return self.metrics()->prometheus(prefix);
+        }, py::arg("prefix") = "aiopvxs_client",
+           "Returns the metrics of stats() in Prometheus text exposition format")
 
-        .def("get", [](Context& self, std::string& pv_name) {
+        .def("get", [](AsyncContext& self, std::string& pv_name,
+                       const std::vector<std::string>& fields, const std::string& request) {
             // the result of this method is an asyncio.Future, so get() can be
             // treated like a co-routine (must await get(...) to retrieve the result)
-            py::object loop = py::module_::import("asyncio").attr("get_event_loop")();
-            py::object py_future = loop.attr("create_future")();
+            auto completions = self.completions();
+            py::object py_future = completions->event_loop().attr("create_future")();
+            auto token = completions->add(py_future);
 
             // make a GetBuilder with result callback that assigns the result of the
             // operation to an asyncio.Future (using either set_result() or set_exception())
-            auto op_builder = self.get(pv_name)
-                .result(pvxs_result_handler(loop, py_future));
+            auto counters = self.counters(&ClientStats::get);
+            auto op_builder = self.get(pv_name);
+            pvxs_request(op_builder, fields, request)
+                .result(pvxs_result_handler(completions, token, counters));
 
             // start the operation
             auto op = op_builder.exec();
             // attach done handler to the asyncio.Future so the operation continues until completion
-            py_future.attr("add_done_callback")(py_future_done_handler(op));
+            py_future.attr("add_done_callback")(py_future_done_handler(op, completions, token, counters));
             // return asyncio.Future representing the future result of the operation
             return py_future;
-        }, "Constructs a GetBuilder for the operation and executes it, returning "
-           "an asyncio.Future representing the future result of the operation")
+        }, py::arg("pv_name"), py::arg("fields") = std::vector<std::string>(), py::arg("request") = "",
+           "Constructs a GetBuilder for the operation and executes it, returning "
+           "an asyncio.Future representing the future result of the operation. Only the "
+           "fields listed in fields, or selected by the pvRequest string request "
+           "(eg. \"field(value,timeStamp)\"), are fetched")
 
-        .def("put", [](Context& self, std::string& pv_name, py::object new_data) {
+        .def("put", [](AsyncContext& self, std::string& pv_name, py::object new_data) {
             // the result of this method is an asyncio.Future, so put() can be
             // treated like a co-routine (must await put(...) to retrieve the result)
-            py::object loop = py::module_::import("asyncio").attr("get_event_loop")();
-            py::object py_future = loop.attr("create_future")();
+            auto completions = self.completions();
+            py::object py_future = completions->event_loop().attr("create_future")();
+            auto token = completions->add(py_future);
 
-            // make a PutBuilder with result callback that assigns the result of the
+            // start an AsyncPut with result callback that assigns the result of the
             // operation to an asyncio.Future (using either set_result() or set_exception())
-            auto op_builder = self.put(pv_name)
-                .fetchPresent(true)
-                .build([new_data](Value&& current) {
-                    // after initial get operation, apply python new_data to the
-                    // pvxs::Value to take advantage of the automatic type casting
-                    Value toput(current.cloneEmpty());
-
-                    // GIL lock not automatically held in C++ callback, acquire GIL lock
-                    py::gil_scoped_acquire lock;
-                    try {
-                        // new_data is a python dictionary, assign it
-                        // to recursively cast each key to its field
-                        py::cast(toput).attr("assign")(new_data);
-                    }
-                    catch (py::error_already_set& e) {
-                        // if any python exceptions are raised, need to catch them all
-                        // here and turn them into C++ exceptions so they can pass to
-                        // the C++ result handler without invoking Python interpreter's
-                        // error handling code
-                        if (e.matches(PyExc_KeyError))
-                            throw py::key_error(e.what());
-                        else if (e.matches(PyExc_TypeError))
-                            throw py::type_error(e.what());
-                        else
-                            throw py::value_error(e.what());
-                    }
-                    return toput;
-                })
-                .result(pvxs_result_handler(loop, py_future));
+            auto counters = self.counters(&ClientStats::put);
+            auto op = AsyncPut::start(self, pv_name, new_data, self.types(), completions, token,
+                                      pvxs_result_handler(completions, token, counters));
 
-            // start the operation
-            auto op = op_builder.exec();
             // attach done handler to the asyncio.Future so the operation continues until completion
-            py_future.attr("add_done_callback")(py_future_done_handler(op));
+            py_future.attr("add_done_callback")(py_future_done_handler(op, completions, token, counters));
             // return asyncio.Future representing the future result of the operation
             return py_future;
-        // the py::keep_alive means the 3rd argument (py::object new_data) must live at least as long
-        // as the return value, otherwise new_data might get cleaned up before .build() callback
-        }, py::keep_alive<0, 3>(), "Constructs a PutBuilder for the operation and executes it, returning "
-                                   "an asyncio.Future representing the future result of the operation")
+        }, "Casts new_data to the type of the PV, then constructs a PutBuilder for the operation "
+           "and executes it, returning an asyncio.Future representing the future result of the operation")
+
+        .def("get_many", [](AsyncContext& self, const std::vector<std::string>& pv_names) {
+            // the result of this method is a single asyncio.Future for all operations,
+            // it resolves to a list with the Value (or exception) of each PV in order
+            auto completions = self.completions();
+            py::object py_future = completions->event_loop().attr("create_future")();
+            py::list py_results;
+            for (size_t i = 0; i < pv_names.size(); i++)
+                py_results.append(py::none());
+            auto token = completions->add(py::make_tuple(py_future, py_results));
+            auto remaining = std::make_shared<size_t>(pv_names.size());
+
+            // make and start a GetBuilder for each PV, with result callback that
+            // stores the result of the operation in the list
+            auto counters = self.counters(&ClientStats::get);
+            std::vector<std::shared_ptr<Operation>> ops;
+            ops.reserve(pv_names.size());
+            for (size_t i = 0; i < pv_names.size(); i++) {
+                ops.push_back(self.get(pv_names[i])
+                    .result(pvxs_gather_handler(completions, token, i, remaining, counters))
+                    .exec());
+            }
+
+            if (pv_names.empty())
+                py_future.attr("set_result")(py_results);
+            // attach done handler to the asyncio.Future so the operations continue until completion
+            py_future.attr("add_done_callback")(py_future_done_handler(ops, completions, token, counters));
+            // return asyncio.Future representing the future result of all operations
+            return py_future;
+        }, "Constructs and executes a GetBuilder for each PV in the list, returning a "
+           "single asyncio.Future that resolves to a list of results (Value or exception) "
+           "in the same order")
+
+        .def("put_many", [](AsyncContext& self, py::dict pv_values) {
+            // the result of this method is a single asyncio.Future for all operations,
+            // it resolves to a list with the result (or exception) of each PV in order
+            auto completions = self.completions();
+            py::object py_future = completions->event_loop().attr("create_future")();
+            py::list py_results;
+            for (size_t i = 0; i < py::len(pv_values); i++)
+                py_results.append(py::none());
+            auto token = completions->add(py::make_tuple(py_future, py_results));
+            auto remaining = std::make_shared<size_t>(py::len(pv_values));
+
+            // start an AsyncPut for each PV, with result callback that
+            // stores the result of the operation in the list
+            auto counters = self.counters(&ClientStats::put);
+            std::vector<std::shared_ptr<AsyncPut>> ops;
+            ops.reserve(py::len(pv_values));
+            size_t i = 0;
+            for (auto item : pv_values) {
+                auto pv_name = item.first.cast<std::string>();
+                auto new_data = py::reinterpret_borrow<py::object>(item.second);
+                ops.push_back(AsyncPut::start(self, pv_name, new_data, self.types(), completions, token,
+                                              pvxs_gather_handler(completions, token, i++, remaining, counters)));
+            }
+
+            if (ops.empty())
+                py_future.attr("set_result")(py_results);
+            // attach done handler to the asyncio.Future so the operations continue until completion
+            py_future.attr("add_done_callback")(py_future_done_handler(ops, completions, token, counters));
+            // return asyncio.Future representing the future result of all operations
+            return py_future;
+        }, "Constructs and executes a PutBuilder for each {'name': new_data} item in the "
+           "dictionary, returning a single asyncio.Future that resolves to a list of results "
+           "(Value or exception) in the same order")
 
-        .def("rpc", [](Context& self, std::string& pv_name, py::kwargs kwargs) {
+        .def("rpc", [](AsyncContext& self, std::string& pv_name, py::kwargs kwargs) {
             // the result of this method is an asyncio.Future, so rpc() can be
             // treated like a co-routine (must await rpc(...) to retrieve the result)
-            py::object loop = py::module_::import("asyncio").attr("get_event_loop")();
-            py::object py_future = loop.attr("create_future")();
+            auto completions = self.completions();
+            py::object py_future = completions->event_loop().attr("create_future")();
+            auto token = completions->add(py_future);
 
             // make an RPCBuilder with result callback that assigns the result of the
             // operation to an asyncio.Future (using either set_result() or set_exception())
+            auto counters = self.counters(&ClientStats::rpc);
             auto op_builder = self.rpc(pv_name)
-                .result(pvxs_result_handler(loop, py_future));
+                .result(pvxs_result_handler(completions, token, counters));
             // add each keyword argument as rpc call argument
             for (auto item : kwargs) {
                 if (py::isinstance<py::int_>(item.second))
@@ -386,57 +1578,59 @@ void create_submodule_client(py::module_& m) {
             // start the operation
             auto op = op_builder.exec();
             // attach done handler to the asyncio.Future so the operation continues until completion
-            py_future.attr("add_done_callback")(py_future_done_handler(op));
+            py_future.attr("add_done_callback")(py_future_done_handler(op, completions, token, counters));
             // return asyncio.Future representing the future result of the operation
             return py_future;
         }, "Constructs an RPCBuilder for the operation and executes it, returning "
            "an asyncio.Future representing the future result of the operation")
 
-        .def("list", [](Context& self, std::string& server_name) {
+        .def("list", [](AsyncContext& self, std::string& server_name) {
             // list is an RPC call with a special set of operations/arguments
-            py::object loop = py::module_::import("asyncio").attr("get_event_loop")();
-            py::object py_future = loop.attr("create_future")();
+            auto completions = self.completions();
+            py::object py_future = completions->event_loop().attr("create_future")();
+            auto token = completions->add(py_future);
 
             // make an RPCBuilder with result callback that assigns the result of the
             // operation to an asyncio.Future (using either set_result() or set_exception())
+            auto counters = self.counters(&ClientStats::rpc);
             auto op_builder = self.rpc("server")
                 .server(server_name)
                 .arg("op", "channels")
-                .result(pvxs_result_handler(loop, py_future));
+                .result(pvxs_result_handler(completions, token, counters));
 
             // start the operation
             auto op = op_builder.exec();
             // attach done handler to the asyncio.Future so the operation continues until completion
-            py_future.attr("add_done_callback")(py_future_done_handler(op));
+            py_future.attr("add_done_callback")(py_future_done_handler(op, completions, token, counters));
             // return asyncio.Future representing the future result of the operation
             return py_future;
         }, "Constructs an RPCBuilder for the list channels operation and executes it, returning "
            "an asyncio.Future representing the future result of the operation")
 
-       .def("discover", [](Context& self, bool do_ping) {
+       .def("discover", [](AsyncContext& self, bool do_ping) {
             // the result of this method is an asyncio.Future,
             // await discover(...) with a timeout
-            py::object loop = py::module_::import("asyncio").attr("get_event_loop")();
+            auto completions = self.completions();
             py::object py_queue = py::module_::import("asyncio").attr("Queue")();
+            auto registration = CompletionQueue::subscribe(completions, py_queue);
+            auto token = registration->token;
 
             // make a DiscoverBuilder
             // callback "cb" is actually a temporary std::function created by pybind11
             // that is moved into op_builder
-            auto op_builder = self.discover([loop, py_queue](const Discovered& srv){
-                    py::gil_scoped_acquire lock;
-
-                    loop.attr("call_soon_threadsafe")(
-                        py::cpp_function([py_queue, srv]() {
-                            py_queue.attr("put_nowait")(srv);
-                        })
-                    );
+            auto op_builder = self.discover([completions, token](const Discovered& srv){
+                    // GIL lock is held by default when the CompletionQueue is drained
+                    completions->push(token, [srv](py::handle py_queue) {
+                        py_queue.attr("put_nowait")(srv);
+                        return false;
+                    });
                 })
                 .pingAll(do_ping);
 
             // start the operation
             auto op = op_builder.exec();
             // attach asyncio.Queue to the Operation so both are kept alive until completion
-            auto sub_with_event = AsyncDiscover(op, py_queue);
+            auto sub_with_event = AsyncDiscover(op, registration, py_queue);
             // return the subscription
             return sub_with_event;
         }, py::arg("do_ping") = true,
@@ -445,50 +1639,100 @@ void create_submodule_client(py::module_& m) {
            "never return a result, rather the discover results will arrive via the provided "
            "callback function.")
 
-        .def("monitor", [](Context& self, std::string& pv_name) {
+        .def("monitor", [](AsyncContext& self, std::string& pv_name,
+                           const std::vector<std::string>& fields, const std::string& request,
+                           size_t queue_size, MonitorOverflow overflow, bool conflate,
+                           py::object into) -> py::object {
             // the result of this method is an aiopvxs.client.Subscription
-            py::object loop = py::module_::import("asyncio").attr("get_event_loop")();
-            py::object py_queue = py::module_::import("asyncio").attr("Queue")();
+            bool latest = conflate || !into.is_none();
+            if (latest && (queue_size > 0 || overflow != MonitorOverflow::DropOldest))
+                throw py::value_error("queue_size and overflow do not apply to conflate=True or into=, "
+                                      "which only keep the latest update");
+
+            auto completions = self.completions();
+            auto stats = self.metrics();
+            stats->subscriptions.fetch_add(1, std::memory_order_relaxed);
+
+            if (latest) {
+                // aiopvxs.client.LatestSubscription, waiting asyncio.Future is registered
+                // along with the object updates are copied into
+                py::list waiter;
+                waiter.append(py::none());
+                waiter.append(into);
+                auto registration = CompletionQueue::subscribe(completions, waiter);
+                auto token = registration->token;
+                auto slot = std::make_shared<LatestSlot>(stats, !into.is_none());
+
+                auto op_builder = self.monitor(pv_name);
+                auto sub = pvxs_request(op_builder, fields, request)
+                    .event([completions, token, slot, stats](Subscription& updated) {
+                        stats->monitor_events.fetch_add(1, std::memory_order_relaxed);
+                        // drain pvxs queue into the slot without GIL, wake up
+                        // the event loop once until the slot is taken
+                        if (slot->fill(updated)) {
+                            completions->push(token, [slot](py::handle waiter) {
+                                AsyncLatestSubscription::resolve(*slot, waiter);
+                                return false;
+                            });
+                        }
+                    })
+                    .exec();
+                return py::cast(AsyncLatestSubscription(sub, registration, completions->event_loop(),
+                                                        waiter, slot));
+            }
+
+            py::object py_queue = py::module_::import("asyncio").attr("Queue")(queue_size);
+            auto registration = CompletionQueue::subscribe(completions, py_queue);
+            auto token = registration->token;
+            auto queue_state = std::make_shared<MonitorQueue>(queue_size, overflow, stats);
+            // Subscription is only known after exec(), but is only used once the
+            // event loop drains the CompletionQueue
+            auto sub_handle = std::make_shared<std::weak_ptr<Subscription>>();
 
             // make a MonitorBuilder
-            auto op_builder = self.monitor(pv_name)
-                .event([loop, py_queue](Subscription& sub) {
-                    // GIL lock not automatically held in C++ callback,
-                    // acquire GIL lock when adding to event loop
-                    py::gil_scoped_acquire lock;
-                    py::object val;
-
-                    try {
+            auto op_builder = self.monitor(pv_name);
+            pvxs_request(op_builder, fields, request)
+                .event([completions, token, sub_handle, queue_state, stats](Subscription&) {
+                    stats->monitor_events.fetch_add(1, std::memory_order_relaxed);
+                    // GIL lock not needed here, the pvxs queue is drained into the
+                    // asyncio.Queue when the event loop drains the CompletionQueue
+                    completions->push(token, [sub_handle, queue_state](py::handle py_queue) {
+                        auto sub = sub_handle->lock();
+                        if (!sub)
+                            return false;
+
                         // there is always something available if this callback
-                        // was called, get it or trigger exception
-                        val = py::cast(sub.pop());
-                    }
-                    catch (const Finished& fin) { val = py::cast(fin); }
-                    catch (const Connected& con) { val = py::cast(con); }
-                    catch (const Disconnect& dis) { val = py::cast(dis); }
-                    catch (const RemoteError& rem) { val = py::cast(rem); }
-                    catch (const std::exception& exc) {
-                        py::print("C++ exception thrown in monitor callback:", exc.what());
-                        val = py::cast(exc);
-                    }
-
-                    // put new data into python queue, unblocks any waiting q.get() calls
-                    loop.attr("call_soon_threadsafe")(
-                        py::cpp_function([py_queue, val]() {
-                            py_queue.attr("put_nowait")(val);
-                        })
-                    );
-
-                    return;
+                        // was called, get as much as fits (or trigger exception)
+                        queue_state->fill(*sub, py_queue);
+                        return false;
+                    });
                 });
+            if (queue_size > 0 && overflow != MonitorOverflow::DropOldest) {
+                // pvxs queue holds what does not fit into the asyncio.Queue
+                op_builder.record("queueSize", uint32_t(queue_size));
+                if (overflow == MonitorOverflow::Block)
+                    op_builder.record("pipeline", true);
+            }
 
             // start the subscription operation
             auto sub = op_builder.exec();
-            // attach asyncio.Event to the Subscription that is set by monitor event callback
-            auto sub_with_event = AsyncSubscription(sub, py_queue);
+            *sub_handle = sub;
+            // attach asyncio.Queue to the Subscription that is filled by monitor event callback
+            auto sub_with_event = AsyncSubscription(sub, registration, completions->event_loop(),
+                                                    py_queue, queue_state);
             // return the subscription
-            return sub_with_event;
-        }, "Constructs a MonitorBuilder for the operation and executes it, returning "
+            return py::cast(sub_with_event);
+        }, py::arg("pv_name"), py::arg("fields") = std::vector<std::string>(), py::arg("request") = "",
+           py::arg("queue_size") = 0, py::arg("overflow") = MonitorOverflow::DropOldest,
+           py::arg("conflate") = false, py::arg("into") = py::none(),
+           "Constructs a MonitorBuilder for the operation and executes it, returning "
            "an aiopvxs.client.Subscription object that can be iterated with an async "
-           "for loop or cancelled.");
+           "for loop or cancelled. With queue_size > 0, at most queue_size updates are "
+           "queued and the overflow policy decides what happens to the others. With "
+           "conflate=True, returns an aiopvxs.client.LatestSubscription that only keeps "
+           "the latest update. With into set to a Value, dict or writable buffer (eg. numpy "
+           "array), each update is copied into that object in place and the object itself is "
+           "returned. into implies conflate=True, so updates that arrive before the previous one "
+           "was taken are merged into it, and neither can be combined with queue_size or "
+           "overflow (ValueError). fields and request select the fields sent, as for get().");
 }
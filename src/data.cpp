@@ -18,6 +18,10 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
  */
 
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+
 #include <pybind11/pybind11.h>
 #include <pybind11/native_enum.h>
 #include <pybind11/stl.h>
@@ -28,6 +32,845 @@
 
 namespace py = pybind11;
 
+static bool value_equal(const Value& lhs, const Value& rhs, double tolerance);
+static py::object value_to_python(const Value& value, bool marked_only = false);
+static py::dict struct_to_python(const Value& value, bool marked_only = false);
+void assign_dict(Value& value, py::dict values_dict);
+py::object update_python(py::handle target, const Value& value);
+
+static inline bool
+real_equal(double lhs, double rhs, double tolerance) {
+    return tolerance > 0.0 ? std::fabs(lhs - rhs) <= tolerance : lhs == rhs;
+}
+
+template <typename T>
+static bool real_array_equal(const shared_array<const void>& lhs, const shared_array<const void>& rhs,
+                             double tolerance) {
+    auto lhs_arr = lhs.castTo<const T>();
+    auto rhs_arr = rhs.castTo<const T>();
+    for (size_t i = 0; i < lhs_arr.size(); i++) {
+        if (!real_equal(lhs_arr[i], rhs_arr[i], tolerance))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * array_equal
+ *
+ * Compares contents of two arrays of the same type. Arrays of integers
+ * are compared with memcmp(), arrays of floats with a tolerance.
+ *
+ */
+static bool array_equal(const shared_array<const void>& lhs, const shared_array<const void>& rhs,
+                        double tolerance) {
+    // unassigned and empty arrays are equal regardless of type
+    if (lhs.empty() && rhs.empty())
+        return true;
+    else if (lhs.original_type() != rhs.original_type() || lhs.size() != rhs.size())
+        return false;
+
+    switch (lhs.original_type()) {
+        case ArrayType::Bool:
+        case ArrayType::UInt8:
+        case ArrayType::Int8:
+            return std::memcmp(lhs.data(), rhs.data(), lhs.size()) == 0;
+        case ArrayType::UInt16:
+        case ArrayType::Int16:
+            return std::memcmp(lhs.data(), rhs.data(), lhs.size() * 2u) == 0;
+        case ArrayType::UInt32:
+        case ArrayType::Int32:
+            return std::memcmp(lhs.data(), rhs.data(), lhs.size() * 4u) == 0;
+        case ArrayType::UInt64:
+        case ArrayType::Int64:
+            return std::memcmp(lhs.data(), rhs.data(), lhs.size() * 8u) == 0;
+        case ArrayType::Float32:
+            return real_array_equal<float>(lhs, rhs, tolerance);
+        case ArrayType::Float64:
+            return real_array_equal<double>(lhs, rhs, tolerance);
+        case ArrayType::String: {
+            auto lhs_arr = lhs.castTo<const std::string>();
+            auto rhs_arr = rhs.castTo<const std::string>();
+            return std::equal(lhs_arr.begin(), lhs_arr.end(), rhs_arr.begin());
+        }
+        case ArrayType::Value: {
+            auto lhs_arr = lhs.castTo<const Value>();
+            auto rhs_arr = rhs.castTo<const Value>();
+            for (size_t i = 0; i < lhs_arr.size(); i++) {
+                if (!value_equal(lhs_arr[i], rhs_arr[i], tolerance))
+                    return false;
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+/*
+ * value_equal
+ *
+ * Walks two Value trees and compares them field by field, returns false
+ * as soon as field names, types or contents differ. Floating point fields
+ * are equal if they differ by at most tolerance.
+ *
+ */
+static bool value_equal(const Value& lhs, const Value& rhs, double tolerance) {
+    if (!lhs.valid() || !rhs.valid())
+        return lhs.valid() == rhs.valid();
+    else if (lhs.type().code != rhs.type().code)
+        return false;
+
+    switch (lhs.storageType()) {
+        case StoreType::Null:
+            return true;
+        case StoreType::Bool:
+            return lhs.as<bool>() == rhs.as<bool>();
+        case StoreType::UInteger:
+            return lhs.as<uint64_t>() == rhs.as<uint64_t>();
+        case StoreType::Integer:
+            return lhs.as<int64_t>() == rhs.as<int64_t>();
+        case StoreType::Real:
+            return real_equal(lhs.as<double>(), rhs.as<double>(), tolerance);
+        case StoreType::String:
+            return lhs.as<std::string>() == rhs.as<std::string>();
+        case StoreType::Array:
+            return array_equal(lhs.as<shared_array<const void>>(),
+                               rhs.as<shared_array<const void>>(), tolerance);
+        case StoreType::Compound:
+            if (lhs.type().code == TypeCode::Struct) {
+                if (lhs.nmembers() != rhs.nmembers())
+                    return false;
+
+                auto lhs_children = lhs.ichildren();
+                auto rhs_children = rhs.ichildren();
+                auto rhs_it = rhs_children.begin();
+                for (auto lhs_it = lhs_children.begin(); lhs_it != lhs_children.end(); ++lhs_it, ++rhs_it) {
+                    if (lhs.nameOf(*lhs_it) != rhs.nameOf(*rhs_it) ||
+                        !value_equal(*lhs_it, *rhs_it, tolerance))
+                        return false;
+                }
+                return true;
+            }
+            else {
+                // Union and Any contain another Value
+                return value_equal(lhs.as<Value>(), rhs.as<Value>(), tolerance);
+            }
+        default:
+            return false;
+    }
+}
+
+
+/*
+ * assign_int
+ *
+ * Assigns python int to Value field, as uint64_t if it does not fit int64_t.
+ *
+ */
+static void assign_int(Value& field, py::handle py_value) {
+    int overflow = 0;
+    long long number = PyLong_AsLongLongAndOverflow(py_value.ptr(), &overflow);
+    if (number == -1 && PyErr_Occurred())
+        throw py::error_already_set();
+
+    if (overflow > 0) {
+        unsigned long long unsigned_number = PyLong_AsUnsignedLongLong(py_value.ptr());
+        if (PyErr_Occurred())
+            throw py::error_already_set();
+        field.from(static_cast<uint64_t>(unsigned_number));
+    }
+    else if (overflow < 0) {
+        throw py::value_error("Python int too small to convert to int64_t");
+    }
+    else {
+        field.from(static_cast<int64_t>(number));
+    }
+}
+
+/*
+ * assign_python
+ *
+ * Casts python object to Value field and assigns it, with the same casts
+ * as the Value.__setattr__() overloads but without pybind11 overload
+ * resolution.
+ *
+ */
+static void assign_python(Value& field, py::handle py_value) {
+    if (PyDict_Check(py_value.ptr())) {
+        assign_dict(field, py::reinterpret_borrow<py::dict>(py_value));
+    }
+    else if (PyLong_Check(py_value.ptr())) {
+        // includes bool
+        assign_int(field, py_value);
+    }
+    else if (PyFloat_Check(py_value.ptr())) {
+        field.from(PyFloat_AS_DOUBLE(py_value.ptr()));
+    }
+    else if (PyUnicode_Check(py_value.ptr())) {
+        field.from(py_value.cast<std::string>());
+    }
+    else if (py::isinstance<Value>(py_value)) {
+        field.assign(py_value.cast<const Value&>());
+    }
+    else if (!PySequence_Check(py_value.ptr()) && PyIndex_Check(py_value.ptr())) {
+        // eg. numpy integer scalars
+        auto number = py::reinterpret_steal<py::object>(PyNumber_Index(py_value.ptr()));
+        if (!number)
+            throw py::error_already_set();
+        assign_int(field, number);
+    }
+    else if (!PySequence_Check(py_value.ptr()) && PyNumber_Check(py_value.ptr())) {
+        // eg. numpy float scalars
+        field.from(py_value.cast<double>());
+    }
+    else if (py::isinstance<py::buffer>(py_value)) {
+        // zero-dimensional buffers hold a single item, eg. memoryview.cast(fmt, ())
+        auto buffer = py::reinterpret_borrow<py::buffer>(py_value);
+        if (buffer.request().ndim == 0)
+            assign_python(field, py::memoryview(buffer).attr("tolist")());
+        else
+            field.from(py_value.cast<shared_array<const void>>());
+    }
+    else if (py::isinstance<py::sequence>(py_value)) {
+        field.from(py_value.cast<shared_array<const void>>());
+    }
+    else {
+        std::stringstream ss;
+        ss << "Unable to assign " << field.type() << " field with python type '"
+           << Py_TYPE(py_value.ptr())->tp_name << "'";
+        throw py::type_error(ss.str());
+    }
+}
+
+/*
+ * assign_dict
+ *
+ * Iterates through python dictionary of {'field name': python value} and
+ * casts each value to its field in Value.
+ *
+ */
+void assign_dict(Value& value, py::dict values_dict) {
+    for (auto item : values_dict) {
+        Value field(value.lookup(item.first.cast<std::string>()));
+        assign_python(field, item.second);
+    }
+}
+
+/*
+ * AssignPlan
+ *
+ * Assignment of python dictionaries with a fixed set of keys, compiled once
+ * for the type of a Value. Each key is validated against the type and paired
+ * with the store type of its field, so apply() skips key validation and the
+ * choice of cast. pvxs has no public API to address a field by position, so
+ * apply() still looks up each field by name. A field whose store type is not
+ * the compiled one, ie. a Value of another type, takes the generic cast.
+ *
+ */
+class AssignPlan {
+public:
+    AssignPlan(const Value& prototype, const std::vector<std::string>& keys) {
+        Value proto(prototype);
+        for (auto& key : keys) {
+            // throws if no such field
+            Value field(proto.lookup(key));
+            entries.push_back(Entry{key, py::str(key), field.storageType()});
+        }
+    }
+
+    void apply(Value& value, py::dict data) const {
+        size_t assigned = 0;
+
+        for (auto& entry : entries) {
+            PyObject* py_value = PyDict_GetItemWithError(data.ptr(), entry.py_key.ptr());
+            if (!py_value) {
+                if (PyErr_Occurred())
+                    throw py::error_already_set();
+                // key not present in this dictionary
+                continue;
+            }
+
+            Value field(value.lookup(entry.key));
+            if (field.storageType() != entry.store)
+                assign_python(field, py_value);
+            else if (entry.store == StoreType::Real && PyFloat_CheckExact(py_value))
+                field.from(PyFloat_AS_DOUBLE(py_value));
+            else if ((entry.store == StoreType::Integer || entry.store == StoreType::UInteger) && PyLong_CheckExact(py_value))
+                assign_int(field, py_value);
+            else if (entry.store == StoreType::String && PyUnicode_CheckExact(py_value))
+                field.from(py::handle(py_value).cast<std::string>());
+            else
+                assign_python(field, py_value);
+            assigned++;
+        }
+
+        // keys that are not part of the plan take the slow path
+        if (assigned < py::len(data)) {
+            for (auto item : data) {
+                if (!is_planned(item.first)) {
+                    Value field(value.lookup(item.first.cast<std::string>()));
+                    assign_python(field, item.second);
+                }
+            }
+        }
+    }
+
+    std::vector<std::string> keys() const {
+        std::vector<std::string> plan_keys;
+        for (auto& entry : entries)
+            plan_keys.push_back(entry.key);
+        return plan_keys;
+    }
+
+private:
+    bool is_planned(py::handle py_key) const {
+        for (auto& entry : entries) {
+            if (entry.py_key.equal(py_key))
+                return true;
+        }
+        return false;
+    }
+
+    struct Entry {
+        std::string key;
+        py::str py_key;
+        StoreType store;
+    };
+
+    std::vector<Entry> entries;
+};
+
+/*
+ * FieldRef
+ *
+ * Handle to one field of a type, resolved once from a dotted path. The path
+ * is validated and kept as a C++ string together with the type of the field.
+ * pvxs has no public access to a field by position, so each use still looks
+ * the path up in the Value, but without parsing it in python, creating a
+ * python Value wrapper for the field or raising exceptions on the miss path.
+ * The type of the field found is checked on each use, so Values of another
+ * type fail instead of being read with the cached store type.
+ *
+ */
+class FieldRef {
+public:
+    FieldRef(const Value& prototype, const std::string& path) : field_path(path) {
+        Value proto(prototype);
+        // throws if no such field
+        Value field(proto.lookup(path));
+        store = field.storageType();
+        code = field.type().code;
+    }
+
+    const std::string& path() const { return field_path; }
+    StoreType storageType() const { return store; }
+    TypeCode::code_t typeCode() const { return code; }
+
+    // field of value, KeyError if value does not have it, TypeError if it has another type
+    Value field(const Value& value) const {
+        Value found(value[field_path]);
+        if (!found.valid())
+            throw py::key_error("Value has no field '" + field_path + "'");
+        if (found.type().code != code)
+            throw py::type_error("Field '" + field_path + "' is " + found.type().name() +
+                                 ", FieldRef was resolved for " + TypeCode(code).name());
+        return found;
+    }
+
+    py::object get(const Value& value) const {
+        Value found(field(value));
+        switch (store) {
+            case StoreType::Bool:
+                return py::bool_(found.as<bool>());
+            case StoreType::UInteger:
+                return py::int_(found.as<uint64_t>());
+            case StoreType::Integer:
+                return py::int_(found.as<int64_t>());
+            case StoreType::Real:
+                return py::float_(found.as<double>());
+            case StoreType::String:
+                return py::str(found.as<std::string>());
+            default:
+                return value_to_python(found);
+        }
+    }
+
+    template <typename T>
+    T get_as(const Value& value) const { return field(value).as<T>(); }
+
+    void set(Value& value, py::handle py_value) const {
+        Value found(field(value));
+        if (store == StoreType::Real && PyFloat_CheckExact(py_value.ptr()))
+            found.from(PyFloat_AS_DOUBLE(py_value.ptr()));
+        else
+            assign_python(found, py_value);
+    }
+
+private:
+    std::string field_path;
+    StoreType store;
+    TypeCode::code_t code;
+};
+
+/*
+ * field_name
+ *
+ * Returns the python string for a field name. Strings are created and
+ * interned once, so every dictionary made by struct_to_python() reuses the
+ * same key objects (with their hash already computed). GIL must be held.
+ *
+ */
+static py::str field_name(const std::string& name) {
+    // never destroyed, python objects can not be released after interpreter shutdown
+    static auto cache = new std::unordered_map<std::string, py::str>();
+
+    auto it = cache->find(name);
+    if (it != cache->end())
+        return it->second;
+
+    // field names are usually a small set, but do not grow without limit
+    if (cache->size() >= 4096u)
+        cache->clear();
+
+    PyObject* key = PyUnicode_FromStringAndSize(name.data(), static_cast<py::ssize_t>(name.size()));
+    if (!key)
+        throw py::error_already_set();
+    PyUnicode_InternInPlace(&key);
+
+    auto py_key = py::reinterpret_steal<py::str>(key);
+    cache->emplace(name, py_key);
+    return py_key;
+}
+
+template <typename T>
+static py::list typed_array_to_python(const shared_array<const void>& sa) {
+    auto arr = sa.castTo<const T>();
+    py::list py_list(arr.size());
+    for (size_t i = 0; i < arr.size(); i++)
+        PyList_SET_ITEM(py_list.ptr(), static_cast<py::ssize_t>(i), py::cast(arr[i]).release().ptr());
+    return py_list;
+}
+
+/*
+ * array_to_python
+ *
+ * Returns a python list with the contents of an array, built directly
+ * from the shared_array storage.
+ *
+ */
+static py::list array_to_python(const shared_array<const void>& sa) {
+    switch (sa.original_type()) {
+        case ArrayType::Null:
+            return py::list();
+        case ArrayType::Bool:
+        case ArrayType::UInt8:
+            return typed_array_to_python<uint8_t>(sa);
+        case ArrayType::UInt16:
+            return typed_array_to_python<uint16_t>(sa);
+        case ArrayType::UInt32:
+            return typed_array_to_python<uint32_t>(sa);
+        case ArrayType::UInt64:
+            return typed_array_to_python<uint64_t>(sa);
+        case ArrayType::Int8:
+            return typed_array_to_python<int8_t>(sa);
+        case ArrayType::Int16:
+            return typed_array_to_python<int16_t>(sa);
+        case ArrayType::Int32:
+            return typed_array_to_python<int32_t>(sa);
+        case ArrayType::Int64:
+            return typed_array_to_python<int64_t>(sa);
+        case ArrayType::Float32:
+            return typed_array_to_python<float>(sa);
+        case ArrayType::Float64:
+            return typed_array_to_python<double>(sa);
+        case ArrayType::String:
+            return typed_array_to_python<std::string>(sa);
+        case ArrayType::Value: {
+            auto arr = sa.castTo<const Value>();
+            py::list py_list;
+            for (auto& item : arr)
+                py_list.append(item.valid() ? value_to_python(item) : py::none().cast<py::object>());
+            return py_list;
+        }
+        default:
+            throw std::runtime_error("Cast not yet implemented.");
+    }
+}
+
+/*
+ * value_to_python
+ *
+ * Returns the equivalent python type of Value, recursing through structures
+ * in C++ without calling back into the python bindings.
+ *
+ */
+static py::object value_to_python(const Value& value, bool marked_only) {
+    if (value.nmembers() > 0)
+        return struct_to_python(value, marked_only);
+
+    switch (value.storageType()) {
+        case StoreType::Bool:
+            return py::bool_(value.as<bool>());
+        case StoreType::UInteger:
+            return py::int_(value.as<uint64_t>());
+        case StoreType::Integer:
+            return py::int_(value.as<int64_t>());
+        case StoreType::Real:
+            return py::float_(value.as<double>());
+        case StoreType::String:
+            return py::str(value.as<std::string>());
+        case StoreType::Array:
+            return array_to_python(value.as<shared_array<const void>>());
+        default:
+            return py::cast(value);
+    }
+}
+
+/*
+ * struct_to_python
+ *
+ * Returns a python dictionary with the outer-most fields of Value. With
+ * marked_only, fields that are not marked (ie. unchanged) are left out.
+ *
+ */
+static py::dict struct_to_python(const Value& value, bool marked_only) {
+    py::dict py_dict;
+    for (auto item : value.ichildren()) {
+        // skip fields that were not sent or changed, unless a parent was
+        if (marked_only && !item.isMarked(true, true))
+            continue;
+        py::object py_item = value_to_python(item, marked_only);
+        if (PyDict_SetItem(py_dict.ptr(), field_name(value.nameOf(item)).ptr(), py_item.ptr()) != 0)
+            throw py::error_already_set();
+    }
+    return py_dict;
+}
+
+/*
+ * ndarray_codecs
+ *
+ * Registry of python decoders for compressed NTNDArray images, keyed by
+ * codec name. GIL must be held.
+ *
+ */
+static py::dict& ndarray_codecs() {
+    // never destroyed, python objects can not be released after interpreter shutdown
+    static auto codecs = new py::dict();
+    return *codecs;
+}
+
+void register_ndarray_codec(const std::string& name, py::object decoder) {
+    if (decoder.is_none())
+        ndarray_codecs().attr("pop")(name, py::none());
+    else
+        ndarray_codecs()[py::str(name)] = decoder;
+}
+
+/*
+ * ndarray_image
+ *
+ * Returns the pixel data of an NTNDArray as a buffer shaped by its dimension
+ * sizes. Uncompressed images share the storage of the Value (no copy). For
+ * compressed images, the decoder registered for codec.name is called with
+ * the raw bytes and the NTNDArray, and its result (eg. bytes) is viewed with
+ * the item format of the uncompressed data and the same shape. That format
+ * comes from codec.parameters, which areaDetector sets to the NDDataType_t
+ * of the uncompressed data, or else from the value union member selected.
+ *
+ */
+py::object ndarray_image(const Value& ndarray) {
+    Value image(ndarray);
+
+    // dimension[0] varies fastest, so it is the last axis of a C-contiguous array
+    std::vector<py::ssize_t> shape;
+    auto dims = image["dimension"].as<shared_array<const void>>().castTo<const Value>();
+    for (size_t i = dims.size(); i-- > 0;) {
+        Value dim(dims[i]);
+        shape.push_back(dim["size"].as<int64_t>());
+    }
+
+    // selected member of the value union
+    Value pixels = image["value"].as<Value>();
+    if (!pixels.valid())
+        throw py::value_error("NTNDArray has no image data");
+    ArrayBuffer buffer(pixels.as<shared_array<const void>>());
+
+    auto codec = image["codec.name"].as<std::string>();
+    if (codec.empty()) {
+        if (!shape.empty())
+            buffer.reshape(shape);
+        return py::cast(std::move(buffer));
+    }
+
+    py::object decoder = ndarray_codecs().attr("get")(codec);
+    if (decoder.is_none())
+        throw py::value_error("No decoder registered for codec '" + codec + "'");
+
+    // item format of the uncompressed data, NDDataType_t values are the index
+    static const char* nd_formats[] = {"b", "B", "h", "H", "i", "I", "q", "Q", "f", "d"};
+    std::string format = buffer.format();
+    Value params = image["codec.parameters"].as<Value>();
+    if (params.valid() && (params.storageType() == StoreType::Integer ||
+                           params.storageType() == StoreType::UInteger)) {
+        auto data_type = params.as<int64_t>();
+        if (data_type < 0 || data_type >= 10)
+            throw py::value_error("Unknown NTNDArray data type " + std::to_string(data_type) +
+                                  " in codec.parameters");
+        format = nd_formats[data_type];
+    }
+
+    py::memoryview decoded(decoder(std::move(buffer), ndarray));
+    py::memoryview raw(decoded.attr("cast")("B"));
+    if (shape.empty())
+        return raw.attr("cast")(format);
+
+    py::ssize_t expected = py::module_::import("struct").attr("calcsize")(format).cast<py::ssize_t>();
+    for (auto size : shape)
+        expected *= size;
+    auto nbytes = raw.attr("nbytes").cast<py::ssize_t>();
+    if (nbytes != expected)
+        throw py::value_error("Decoded image has " + std::to_string(nbytes) + " bytes, expected " +
+                              std::to_string(expected) + " for format '" + format + "'");
+    return raw.attr("cast")(format, py::cast(shape));
+}
+
+/*
+ * ndarray_set_image
+ *
+ * Stores an uncompressed image into an NTNDArray. The value union member is
+ * selected from the item type of data, and dimension sizes are taken from
+ * the buffer shape (last axis first).
+ *
+ */
+void ndarray_set_image(Value& ndarray, py::buffer data) {
+    py::buffer_info info = data.request();
+    std::vector<py::ssize_t> shape(info.shape);
+
+    // flatten, buffer must be C-contiguous
+    py::buffer flat = data;
+    if (info.ndim != 1)
+        flat = py::memoryview(data).attr("cast")("B").attr("cast")(info.format);
+
+    // load_from_python_array() throws runtime_error for item types it has no conversion for
+    shared_array<const void> sa;
+    bool loaded = false;
+    try {
+        loaded = load_from_python_array(flat, sa);
+    }
+    catch (const std::runtime_error&) {
+        loaded = false;
+    }
+    if (!loaded)
+        throw py::type_error("Unsupported NTNDArray item type '" + info.format + "'");
+
+    const char* member;
+    switch (sa.original_type()) {
+        case ArrayType::Int8:    member = "value->byteValue"; break;
+        case ArrayType::UInt8:   member = "value->ubyteValue"; break;
+        case ArrayType::Int16:   member = "value->shortValue"; break;
+        case ArrayType::UInt16:  member = "value->ushortValue"; break;
+        case ArrayType::Int32:   member = "value->intValue"; break;
+        case ArrayType::UInt32:  member = "value->uintValue"; break;
+        case ArrayType::Int64:   member = "value->longValue"; break;
+        case ArrayType::UInt64:  member = "value->ulongValue"; break;
+        case ArrayType::Float32: member = "value->floatValue"; break;
+        case ArrayType::Float64: member = "value->doubleValue"; break;
+        default:
+            throw py::type_error("Unsupported NTNDArray item type");
+    }
+    ndarray[member] = sa;
+
+    Value dimension = ndarray["dimension"];
+    shared_array<Value> dims(shape.size());
+    for (size_t i = 0; i < dims.size(); i++) {
+        dims[i] = dimension.allocMember();
+        dims[i]["size"] = static_cast<int32_t>(shape[shape.size() - 1 - i]);
+    }
+    dimension = freeze(std::move(dims)).castTo<const void>();
+
+    auto nbytes = static_cast<int64_t>(sa.size() * info.itemsize);
+    ndarray["compressedSize"] = nbytes;
+    ndarray["uncompressedSize"] = nbytes;
+    ndarray["codec.name"] = "";
+}
+
+/*
+ * update_dict
+ *
+ * Updates a python dictionary in place with the marked fields of Value.
+ * Sub-structures are updated recursively when the dictionary already holds
+ * a dictionary for them.
+ *
+ */
+static void update_dict(py::dict target, const Value& value) {
+    for (auto item : value.ichildren()) {
+        if (!item.isMarked(true, true))
+            continue;
+        py::str key = field_name(value.nameOf(item));
+        if (item.type().code == TypeCode::Struct) {
+            PyObject* existing = PyDict_GetItem(target.ptr(), key.ptr());
+            if (existing && PyDict_Check(existing)) {
+                update_dict(py::reinterpret_borrow<py::dict>(existing), item);
+                continue;
+            }
+        }
+        py::object py_item = value_to_python(item, true);
+        if (PyDict_SetItem(target.ptr(), key.ptr(), py_item.ptr()) != 0)
+            throw py::error_already_set();
+    }
+}
+
+template <typename T>
+static inline bool item_type_is(const py::buffer_info& info) {
+    return info.item_type_is_equivalent_to<T>();
+}
+
+/*
+ * update_buffer
+ *
+ * Copies the array of Value (or of its 'value' field) into a writable,
+ * C-contiguous python buffer with the same item type and number of items,
+ * eg. a pre-allocated numpy array.
+ *
+ */
+static void update_buffer(py::handle target, const Value& value) {
+    Value field(value);
+    if (field.type().code == TypeCode::Struct)
+        field = field["value"];
+    if (field.type().code == TypeCode::Union)
+        field = field.as<Value>();
+    if (!field.valid() || !field.type().isarray())
+        throw py::type_error("Value has no array to copy into buffer");
+    auto sa = field.as<shared_array<const void>>();
+
+    // released when info goes out of scope
+    auto view = new Py_buffer();
+    if (PyObject_GetBuffer(target.ptr(), view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | PyBUF_WRITABLE) != 0) {
+        delete view;
+        throw py::error_already_set();
+    }
+    py::buffer_info info(view);
+
+    bool same_type;
+    switch (sa.original_type()) {
+        case ArrayType::Bool:    same_type = item_type_is<bool>(info); break;
+        case ArrayType::Int8:    same_type = item_type_is<int8_t>(info); break;
+        case ArrayType::UInt8:   same_type = item_type_is<uint8_t>(info); break;
+        case ArrayType::Int16:   same_type = item_type_is<int16_t>(info); break;
+        case ArrayType::UInt16:  same_type = item_type_is<uint16_t>(info); break;
+        case ArrayType::Int32:   same_type = item_type_is<int32_t>(info); break;
+        case ArrayType::UInt32:  same_type = item_type_is<uint32_t>(info); break;
+        case ArrayType::Int64:   same_type = item_type_is<int64_t>(info); break;
+        case ArrayType::UInt64:  same_type = item_type_is<uint64_t>(info); break;
+        case ArrayType::Float32: same_type = item_type_is<float>(info); break;
+        case ArrayType::Float64: same_type = item_type_is<double>(info); break;
+        default:
+            throw py::type_error("Only numeric arrays can be copied into a buffer");
+    }
+    if (!same_type)
+        throw py::type_error("Buffer item type '" + info.format + "' does not match array");
+    if (static_cast<size_t>(info.size) != sa.size())
+        throw py::value_error("Buffer has " + std::to_string(info.size) + " items, array has "
+                              + std::to_string(sa.size()));
+
+    if (!sa.empty())
+        std::memcpy(info.ptr, sa.data(), sa.size() * static_cast<size_t>(info.itemsize));
+}
+
+/*
+ * update_python
+ *
+ * Updates target in place with Value and returns it, without allocating a
+ * new wrapper. target is either a Value (marked fields are assigned), a
+ * dictionary (marked fields are converted) or a writable buffer (array is
+ * copied). GIL must be held.
+ *
+ */
+py::object update_python(py::handle target, const Value& value) {
+    if (py::isinstance<Value>(target))
+        target.cast<Value&>().assign(value);
+    else if (PyDict_Check(target.ptr()))
+        update_dict(py::reinterpret_borrow<py::dict>(target), value);
+    else if (PyObject_CheckBuffer(target.ptr()))
+        update_buffer(target, value);
+    else
+        throw py::type_error("Can only update Value, dict or writable buffer in place");
+    return py::reinterpret_borrow<py::object>(target);
+}
+
+/*
+ * extract_column
+ *
+ * Copies one field of every Value into a new contiguous array. Does not
+ * need the GIL.
+ *
+ */
+template <typename T>
+static shared_array<const void> extract_column(const std::vector<Value>& values, const std::string& path) {
+    shared_array<T> column(values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+        Value field(values[i][path]);
+        if (!field.valid())
+            throw py::key_error("Value at index " + std::to_string(i) + " has no field '" + path + "'");
+        column[i] = field.as<T>();
+    }
+    return freeze(std::move(column)).template castTo<const void>();
+}
+
+/*
+ * extract
+ *
+ * Returns a dictionary {path: column} with one field of every Value in a
+ * sequence. Numeric and bool columns are ArrayBuffers (float64, int64,
+ * uint64 or bool, by the store type of the field in the first Value), string
+ * columns are lists of str. The Values are walked without the GIL.
+ *
+ */
+static py::dict extract(py::sequence py_values, const std::vector<std::string>& paths) {
+    // copies hold the Values while the GIL is released
+    std::vector<Value> values;
+    values.reserve(py::len(py_values));
+    for (auto item : py_values)
+        values.push_back(item.cast<Value>());
+
+    py::dict columns;
+    for (auto& path : paths) {
+        StoreType store = StoreType::Real;
+        if (!values.empty()) {
+            Value first(values[0][path]);
+            if (!first.valid())
+                throw py::key_error("Value at index 0 has no field '" + path + "'");
+            store = first.storageType();
+        }
+
+        shared_array<const void> column;
+        {
+            py::gil_scoped_release nogil;
+            switch (store) {
+                case StoreType::Real:
+                    column = extract_column<double>(values, path); break;
+                case StoreType::Integer:
+                    column = extract_column<int64_t>(values, path); break;
+                case StoreType::UInteger:
+                    column = extract_column<uint64_t>(values, path); break;
+                case StoreType::Bool:
+                    column = extract_column<bool>(values, path); break;
+                case StoreType::String:
+                    column = extract_column<std::string>(values, path); break;
+                default:
+                    throw py::type_error("Field '" + path + "' is not a scalar");
+            }
+        }
+
+        if (store == StoreType::String)
+            columns[py::str(path)] = array_to_python(column);
+        else
+            columns[py::str(path)] = ArrayBuffer(column);
+    }
+    return columns;
+}
+
 
 void create_submodule_data(py::module_& m) {
     m.doc() = "Data Type and Value classes";
@@ -105,6 +948,57 @@ void create_submodule_data(py::module_& m) {
             return ss.str();
         });
 
+    py::class_<ArrayBuffer>(m, "ArrayBuffer", py::buffer_protocol(),
+                            "Read-only buffer sharing the storage of an array Value (no copy)")
+        .def_buffer(&ArrayBuffer::buffer)
+        .def("__len__", &ArrayBuffer::size)
+        .def_property_readonly("itemsize", &ArrayBuffer::itemsize, "Size of one item in bytes")
+        .def_property_readonly("format", &ArrayBuffer::format, "struct module format string of items")
+        .def_property_readonly("shape", &ArrayBuffer::shape, "Dimensions of the buffer, slowest varying first")
+        .def("reshape", [](ArrayBuffer& self, const std::vector<py::ssize_t>& shape) -> ArrayBuffer& {
+            self.reshape(shape);
+            return self;
+        }, py::arg("shape"), py::return_value_policy::reference_internal,
+           "View the same storage with new dimensions (C order)")
+        .def("__repr__", [](const ArrayBuffer& self) {
+            std::stringstream ss;
+            ss << "ArrayBuffer(format='" << self.format() << "', shape=(";
+            for (auto dim : self.shape())
+                ss << dim << ",";
+            ss << "))";
+            return ss.str();
+        });
+
+    py::class_<AssignPlan>(m, "AssignPlan", "Compiled assignment of python dictionaries with a fixed set of keys. "
+                                            "Keys are validated and casts chosen once, fields are still looked "
+                                            "up by name on every apply()")
+        .def("apply", &AssignPlan::apply, py::arg("value"), py::arg("data"),
+                      "Cast values of python dictionary to fields of Value")
+        .def("keys", &AssignPlan::keys, "Returns list of keys the AssignPlan was compiled for");
+
+    py::class_<FieldRef>(m, "FieldRef", "Field of a type resolved once from a dotted path, "
+                                        "for repeated access to that field of same-typed Values. "
+                                        "Each access still looks the path up in the Value and "
+                                        "raises TypeError if the field found has another type")
+        .def(py::init<const Value&, const std::string&>(), py::arg("prototype"), py::arg("path"),
+             "Resolve path (eg. 'alarm.severity') in the type of prototype Value")
+        .def(py::init([](const TypeDef& type, const std::string& path) {
+            return FieldRef(type.create(), path);
+        }), py::arg("type"), py::arg("path"), "Resolve path (eg. 'alarm.severity') in TypeDef")
+        .def_property_readonly("path", &FieldRef::path, "Dotted path of the field")
+        .def_property_readonly("code", &FieldRef::typeCode, "TypeCodeEnum of the field")
+        .def("field", &FieldRef::field, py::arg("value"), "Return the field of value as Value (no casting)")
+        .def("get", &FieldRef::get, py::arg("value"), "Return the field of value as python value")
+        .def("get_float", &FieldRef::get_as<double>, py::arg("value"), "Return the field of value as python float")
+        .def("get_int", &FieldRef::get_as<int64_t>, py::arg("value"), "Return the field of value as python int")
+        .def("get_bool", &FieldRef::get_as<bool>, py::arg("value"), "Return the field of value as python bool")
+        .def("get_string", &FieldRef::get_as<std::string>, py::arg("value"),
+                           "Return the field of value as python string")
+        .def("set", &FieldRef::set, py::arg("value"), py::arg("data"), "Cast python data to the field of value")
+        .def("__repr__", [](const FieldRef& self) {
+            return "FieldRef('" + self.path() + "')";
+        });
+
     py::class_<Value>(m, "Value", "Generic data container")
 
         .def(py::init<const Value&>())
@@ -115,17 +1009,34 @@ void create_submodule_data(py::module_& m) {
         .def("cloneEmpty", &Value::cloneEmpty,
                            "Return empty-initialised Value with same TypeDef")
 
+        .def("update_into", [](const Value& self, py::object target) {
+            return update_python(target, self);
+        }, py::arg("target"),
+           "Update Value, dict or writable buffer (eg. numpy array) target in place "
+           "with the marked fields of this Value, and return target")
+
+        .def("isMarked", &Value::isMarked, py::arg("parents") = true, py::arg("children") = false,
+                         "Test if this field (or a parent, or a child field) is marked as changed")
+        .def("unmark", [](Value& self) {
+            self.unmark(false, true);
+        }, "Clear changed mark of this field and all child fields")
+
         .def("equalInst", &Value::equalInst,
                           "Test for instance equality (ie: this==this)")
         .def("equalType", &Value::equalType,
                           "Test for type and field name equality")
 
+        .def("equalValue", [](const Value& self, const Value& other, double tolerance) {
+            return value_equal(self, other, tolerance);
+        }, py::arg("other"), py::arg("tolerance") = 0.0,
+           "Test for value equality, floating point fields are equal if they differ by at most tolerance")
+
         .def("__eq__", [](const Value& self, const Value& other){
-            return py::cast(self).attr("as_dict")().attr("__eq__")(py::cast(other).attr("as_dict")());
-        }, "Test for value equality (dictionary representation is equal)")
+            return value_equal(self, other, 0.0);
+        }, "Test for value equality (same field names, types and contents)")
         .def("__ne__", [](const Value& self, const Value& other){
-            return py::cast(self).attr("as_dict")().attr("__ne__")(py::cast(other).attr("as_dict")());
-        }, "Test for value inequality (dictionary representation is not equal)")
+            return !value_equal(self, other, 0.0);
+        }, "Test for value inequality (field names, types or contents differ)")
 
         .def("__iter__", [](const Value& self) {
             return py::make_iterator(self.ichildren().begin(), self.ichildren().end());
@@ -138,29 +1049,18 @@ void create_submodule_data(py::module_& m) {
 
         .def("assign", &Value::assign, "Assign new Value to Value (no casting)")
         .def("assign", [](const Value& self, py::dict values_dict) {
-            for (auto item : values_dict) {
-                const std::string key = item.first.cast<std::string>();
-                const py::object& py_value = py::reinterpret_borrow<py::object>(item.second);
-                //try {
-                    py::cast(self).attr("__setattr__")(key, py_value);
-                //}
-                /*catch (py::error_already_set& e) {
-                    std::stringstream ss;
-                    if (e.matches(PyExc_KeyError)) {
-                        ss << "No such field '" << key << "'";
-                        py::raise_from(e, PyExc_KeyError, ss.str().c_str());
-                    }
-                    else if (e.matches(PyExc_TypeError)) {
-                        auto pvxs_typename = self.lookup(key).type();
-                        auto py_typename = py::str(py_value.attr("__class__").attr("__name__"));
-                        ss << "Unable to assign " << pvxs_typename << " field '" << key << "' ";
-                        ss << "with " << py_typename << " '" << py_value << "'";
-                        py::raise_from(e, PyExc_TypeError, ss.str().c_str());
-                    }
-                    throw py::error_already_set();
-                }*/
-            }
+            Value target(self);
+            assign_dict(target, values_dict);
         }, "Iterate through python dictionary and cast values to Value fields")
+        .def("field_ref", [](const Value& self, const std::string& path) {
+            return FieldRef(self, path);
+        }, py::arg("path"), "Return a FieldRef for path, that can be used with any Value with the "
+                            "same type as this one")
+
+        .def("compile_assign", [](const Value& self, const std::vector<std::string>& keys) {
+            return AssignPlan(self, keys);
+        }, py::arg("keys"), "Compile an AssignPlan for python dictionaries with these keys, "
+                            "that can be applied to any Value with the same type as this one")
 
         .def("__setattr__", static_cast<Value& (Value::*)(std::string&, const int64_t&)>(&Value::update<const int64_t&, std::string&>),
                             "Lookup field in Value and cast python int to Value")
@@ -171,7 +1071,8 @@ void create_submodule_data(py::module_& m) {
         .def("__setattr__", static_cast<Value& (Value::*)(std::string&, const shared_array<const void>&)>(&Value::update<const shared_array<const void>&, std::string&>),
                             "Lookup field in Value and cast python list or array to Value")
         .def("__setattr__", [](const Value& self, std::string& name, py::dict values_dict) {
-            py::cast(self.lookup(name)).attr("assign")(values_dict);
+            Value field(Value(self).lookup(name));
+            assign_dict(field, values_dict);
         }, "Lookup field in Value and cast python dictionary to Value")
 
         .def("__setitem__", static_cast<Value& (Value::*)(std::string&, const int64_t&)>(&Value::update<const int64_t&, std::string&>),
@@ -183,16 +1084,16 @@ void create_submodule_data(py::module_& m) {
         .def("__setitem__", static_cast<Value& (Value::*)(std::string&, const shared_array<const void>&)>(&Value::update<const shared_array<const void>&, std::string&>),
                             "Lookup field in Value and cast python list or array to Value")
         .def("__setitem__", [](const Value& self, std::string& name, py::dict values_dict) {
-            py::cast(self.lookup(name)).attr("assign")(values_dict);
+            Value field(Value(self).lookup(name));
+            assign_dict(field, values_dict);
         }, "Lookup field in Value and cast python dictionary to Value")
 
         .def("get", [](const Value& self, const std::string& name, py::object def_value) {
-            try {
-                return py::cast(self.lookup(name));
-            }
-            catch (const std::exception& e) {
+            // operator[] returns an invalid Value on a miss, no exception
+            Value field(self[name]);
+            if (!field.valid())
                 return def_value;
-            }
+            return py::cast(field);
         }, py::arg("name"), py::arg("def_value") = py::none(),
            "Lookup field from Value and cast to python value if found, otherwise return python None")
 
@@ -213,82 +1114,67 @@ void create_submodule_data(py::module_& m) {
                         "Cast Value to python int")
 
         .def("as_list", [](const Value& self) {
-            auto sa = self.as<shared_array<const void>>();
-            if (sa.original_type() == ArrayType::String)
-                return py::cast(sa);
-            else if (sa.original_type() == ArrayType::Null)
-                return py::list().cast<py::object>();
-            else
-                return py::cast(sa).attr("tolist")();
+            return array_to_python(self.as<shared_array<const void>>());
         }, "Returns a python list representation of Value")
 
-        .def("as_py", [](const Value& self) {
-            if (self.nmembers() > 0) {
-                return py::cast(self).attr("as_dict")();
-            }
-            else {
-                switch(self.storageType()) {
-                    case StoreType::Bool:
-                        return py::cast(self.as<bool>());
-                    case StoreType::UInteger:
-                    case StoreType::Integer:
-                        return py::cast(self.as<int64_t>());
-                    case StoreType::Real:
-                        return py::cast(self.as<double>());
-                    case StoreType::String:
-                        return py::cast(self.as<std::string>());
-                    case StoreType::Array:
-                        return py::cast(self).attr("as_list")();
-                    default:
-                        return py::cast(self);
-                }
-            }
-        }, "Returns the equivalent python type representation of Value")
-
-        .def("as_dict", [](const Value& self) {
-            py::dict py_dict;
-            for (auto item : self.ichildren()) {
-                auto key = py::str(self.nameOf(item));
-                if (item.nmembers() > 0) {
-                    py_dict[key] = py::cast(item).attr("as_dict")();
-                }
-                else {
-                    switch(item.storageType()) {
-                        case StoreType::Bool:
-                            py_dict[key] = py::cast(item.as<bool>());
-                            break;
-                        case StoreType::UInteger:
-                        case StoreType::Integer:
-                            py_dict[key] = py::cast(item.as<int64_t>());
-                            break;
-                        case StoreType::Real:
-                            py_dict[key] = py::cast(item.as<double>());
-                            break;
-                        case StoreType::String:
-                            py_dict[key] = py::cast(item.as<std::string>());
-                            break;
-                        case StoreType::Array:
-                            py_dict[key] = py::cast(item).attr("as_list")();
-                            break;
-                        default:
-                            py_dict[key] = py::cast(item);
-                    }
-                }
-            }
-            return py_dict;
-        }, "Returns a python dictionary representation of Value")
+        .def("as_py", &value_to_python, py::arg("marked_only") = false,
+                      "Returns the equivalent python type representation of Value "
+                      "(with marked_only=True, structures only include marked fields)")
+
+        .def("as_dict", &struct_to_python, py::arg("marked_only") = false,
+                        "Returns a python dictionary representation of Value "
+                        "(with marked_only=True, only includes marked fields)")
 
         .def("as_array", static_cast<shared_array<const void> (Value::*)(void) const>(&Value::as<shared_array<const void>>),
                          "Returns a python array.array() representation of Value")
 
+        .def("as_buffer", [](const Value& self) {
+            return ArrayBuffer(self.as<shared_array<const void>>());
+        }, "Returns a read-only buffer that shares the array storage of Value (no copy), "
+           "eg. for memoryview() or numpy.asarray()")
+        .def("columns", [](const Value& self) {
+            // NTTable columns are the fields of the 'value' sub-structure
+            Value table(self);
+            Value value_field(table["value"]);
+            if (value_field.valid() && value_field.type().code == TypeCode::Struct)
+                table = value_field;
+
+            py::dict py_columns;
+            for (auto column : table.ichildren()) {
+                auto sa = column.as<shared_array<const void>>();
+                if (sa.original_type() == ArrayType::String || sa.original_type() == ArrayType::Value)
+                    py_columns[field_name(table.nameOf(column))] = array_to_python(sa);
+                else
+                    py_columns[field_name(table.nameOf(column))] = ArrayBuffer(sa);
+            }
+            return py_columns;
+        }, "Returns dictionary of {'column name': column} of an NTTable Value, where numeric "
+           "columns are read-only buffers that share the array storage (no copy) and other "
+           "columns are python lists")
+
         // convenient to call these instead of .as_array().tolist()
         .def("as_int_list", [](const Value& self) {
+            auto sa = self.as<shared_array<const void>>();
+            switch (sa.original_type()) {
+                case ArrayType::Float32:
+                case ArrayType::Float64:
+                case ArrayType::String:
+                case ArrayType::Null:
+                    break;
+                default:
+                    // integer types are already ints, skip re-casting to "q" array
+                    return py::cast(sa).attr("tolist")();
+            }
             py::object array_array = py::module_::import("array").attr("array");
-            return array_array("q", self.as<shared_array<const void>>()).attr("tolist")();
+            return array_array("q", py::cast(sa)).attr("tolist")();
         }, "Returns a python list[int] representation of Value")
         .def("as_float_list", [](const Value& self) {
+            auto sa = self.as<shared_array<const void>>();
+            if (sa.original_type() == ArrayType::Float32 || sa.original_type() == ArrayType::Float64)
+                // already floats, skip re-casting to "d" array
+                return py::cast(sa).attr("tolist")();
             py::object array_array = py::module_::import("array").attr("array");
-            return array_array("d", self.as<shared_array<const void>>()).attr("tolist")();
+            return array_array("d", py::cast(sa)).attr("tolist")();
         }, "Returns a python list[float] representation of Value")
         .def("as_string_list", [](const Value& self) {
             auto sa = self.as<shared_array<const void>>();
@@ -324,4 +1210,9 @@ void create_submodule_data(py::module_& m) {
             ss << self;
             return ss.str();
         }, "Returns a string representation of Value");
+
+    m.def("extract", &extract, py::arg("values"), py::arg("fields"),
+          "Extract fields (eg. ['value', 'timeStamp.secondsPastEpoch']) of every Value in a "
+          "sequence into a dictionary of columns. Numeric columns are ArrayBuffers (float64, "
+          "int64, uint64 or bool by the type of the field), string columns are lists of str");
 }
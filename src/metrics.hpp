@@ -0,0 +1,252 @@
+/*
+ * Project: aiopvxs
+ * File:    metrics.hpp
+ *
+ * This file is part of aiopvxs.
+ *
+ * https://github.com/m2es3h/aiopvxs
+ *
+ * Copyright (C) Michael Smith. All rights reserved.
+ *
+ * aiopvxs is free software: you can redistribute it and/or modify it
+ * under the terms of The 3-Clause BSD License.
+ *
+ * https://opensource.org/license/bsd-3-clause
+ *
+ * aiopvxs is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef AIOPVXS_METRICS_HPP
+#define AIOPVXS_METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <pybind11/pybind11.h>
+
+namespace py = pybind11;
+
+typedef std::chrono::steady_clock metrics_clock;
+
+/*
+ * LatencyHistogram
+ *
+ * Histogram of durations with fixed buckets, safe to update from any thread
+ * without a lock. Reading while other threads update gives counts that are
+ * each correct, but not necessarily from the same instant.
+ *
+ */
+class LatencyHistogram {
+public:
+    enum { nbounds = 11 };
+
+    LatencyHistogram() { reset(); }
+
+    // upper bound of each bucket in seconds, the last bucket has no bound
+    static const double* bounds() {
+        static const double upper[nbounds] = {
+            10e-6, 50e-6, 100e-6, 500e-6, 1e-3, 5e-3, 10e-3, 50e-3, 100e-3, 500e-3, 1.0,
+        };
+        return upper;
+    }
+
+    void record(metrics_clock::duration elapsed) {
+        double seconds = std::chrono::duration<double>(elapsed).count();
+        size_t i = 0;
+        while (i < nbounds && seconds > bounds()[i])
+            i++;
+        buckets[i].fetch_add(1, std::memory_order_relaxed);
+        sum_ns.fetch_add(static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()), std::memory_order_relaxed);
+    }
+
+    void reset() {
+        for (auto& bucket : buckets)
+            bucket.store(0, std::memory_order_relaxed);
+        sum_ns.store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        uint64_t total = 0;
+        for (auto& bucket : buckets)
+            total += bucket.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    double sum() const { return sum_ns.load(std::memory_order_relaxed) * 1e-9; }
+
+    // {'buckets': {upper bound: cumulative count, ..., 'inf': count}, 'count': n, 'sum': seconds}
+    py::dict to_python() const {
+        py::dict py_buckets;
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i <= nbounds; i++) {
+            cumulative += buckets[i].load(std::memory_order_relaxed);
+            if (i < nbounds)
+                py_buckets[py::float_(bounds()[i])] = cumulative;
+            else
+                py_buckets[py::str("inf")] = cumulative;
+        }
+        py::dict py_hist;
+        py_hist["buckets"] = py_buckets;
+        py_hist["count"] = cumulative;
+        py_hist["sum"] = sum();
+        return py_hist;
+    }
+
+    void prometheus(std::ostream& out, const std::string& name, const std::string& labels) const {
+        uint64_t cumulative = 0;
+        std::string sep = labels.empty() ? "" : ",";
+        for (size_t i = 0; i <= nbounds; i++) {
+            cumulative += buckets[i].load(std::memory_order_relaxed);
+            out << name << "_bucket{" << labels << sep << "le=\"";
+            if (i < nbounds)
+                out << bounds()[i];
+            else
+                out << "+Inf";
+            out << "\"} " << cumulative << "\n";
+        }
+        std::string braces = labels.empty() ? "" : "{" + labels + "}";
+        out << name << "_sum" << braces << " " << sum() << "\n";
+        out << name << "_count" << braces << " " << cumulative << "\n";
+    }
+
+private:
+    std::atomic<uint64_t> buckets[nbounds + 1];
+    std::atomic<uint64_t> sum_ns;
+};
+
+/*
+ * OpCounters
+ *
+ * Counts operations of one kind from start to completion, with a histogram
+ * of how long they took. Safe to update from any thread without a lock.
+ *
+ */
+struct OpCounters {
+    OpCounters() : issued(0), completed(0), cancelled(0), failed(0) {}
+
+    metrics_clock::time_point start(uint64_t count = 1) {
+        issued.fetch_add(count, std::memory_order_relaxed);
+        return metrics_clock::now();
+    }
+
+    void finish(metrics_clock::time_point started, uint64_t count = 1) {
+        completed.fetch_add(count, std::memory_order_relaxed);
+        latency.record(metrics_clock::now() - started);
+    }
+
+    void cancel(uint64_t count = 1) { cancelled.fetch_add(count, std::memory_order_relaxed); }
+    void fail(uint64_t count = 1) { failed.fetch_add(count, std::memory_order_relaxed); }
+
+    uint64_t in_flight() const {
+        uint64_t done = completed.load(std::memory_order_relaxed) + cancelled.load(std::memory_order_relaxed);
+        uint64_t started = issued.load(std::memory_order_relaxed);
+        return started > done ? started - done : 0;
+    }
+
+    void reset() {
+        // in-flight operations are carried over, so in_flight() stays correct
+        uint64_t running = in_flight();
+        issued.store(running, std::memory_order_relaxed);
+        completed.store(0, std::memory_order_relaxed);
+        cancelled.store(0, std::memory_order_relaxed);
+        failed.store(0, std::memory_order_relaxed);
+        latency.reset();
+    }
+
+    py::dict to_python() const {
+        py::dict py_ops;
+        py_ops["issued"] = issued.load(std::memory_order_relaxed);
+        py_ops["completed"] = completed.load(std::memory_order_relaxed);
+        py_ops["failed"] = failed.load(std::memory_order_relaxed);
+        py_ops["cancelled"] = cancelled.load(std::memory_order_relaxed);
+        py_ops["in_flight"] = in_flight();
+        py_ops["latency"] = latency.to_python();
+        return py_ops;
+    }
+
+    std::atomic<uint64_t> issued;
+    std::atomic<uint64_t> completed;
+    std::atomic<uint64_t> cancelled;
+    std::atomic<uint64_t> failed;
+    LatencyHistogram latency;
+};
+
+/*
+ * prometheus_metric
+ *
+ * Writes one metric without labels in Prometheus text format.
+ *
+ */
+template <typename T>
+void prometheus_metric(std::ostream& out, const std::string& name, const char* type, T value) {
+    out << "# TYPE " << name << " " << type << "\n";
+    out << name << " " << value << "\n";
+}
+
+/*
+ * prometheus_ops
+ *
+ * Writes the OpCounters of each kind of operation in Prometheus text format,
+ * labelled op="<kind>". Samples of one metric must be grouped together, so
+ * each metric is written for every kind in turn.
+ *
+ */
+typedef std::vector<std::pair<std::string, const OpCounters*>> op_counters_t;
+
+inline void
+prometheus_ops(std::ostream& out, const std::string& prefix, const op_counters_t& ops) {
+    struct Counter {
+        const char* suffix;
+        const char* type;
+        std::atomic<uint64_t> OpCounters::*member;
+    };
+    static const Counter counters[] = {
+        {"_ops_issued_total", "counter", &OpCounters::issued},
+        {"_ops_completed_total", "counter", &OpCounters::completed},
+        {"_ops_failed_total", "counter", &OpCounters::failed},
+        {"_ops_cancelled_total", "counter", &OpCounters::cancelled},
+    };
+
+    for (auto& counter : counters) {
+        out << "# TYPE " << prefix << counter.suffix << " " << counter.type << "\n";
+        for (auto& op : ops)
+            out << prefix << counter.suffix << "{op=\"" << op.first << "\"} "
+                << (op.second->*counter.member).load(std::memory_order_relaxed) << "\n";
+    }
+
+    out << "# TYPE " << prefix << "_ops_in_flight gauge\n";
+    for (auto& op : ops)
+        out << prefix << "_ops_in_flight{op=\"" << op.first << "\"} " << op.second->in_flight() << "\n";
+
+    out << "# TYPE " << prefix << "_op_latency_seconds histogram\n";
+    for (auto& op : ops)
+        op.second->latency.prometheus(out, prefix + "_op_latency_seconds", "op=\"" + op.first + "\"");
+}
+
+/*
+ * timed_gil_acquire
+ *
+ * Acquires the GIL like py::gil_scoped_acquire, recording how long the
+ * calling thread waited for it.
+ *
+ */
+class timed_gil_acquire {
+public:
+    explicit timed_gil_acquire(LatencyHistogram& wait) : started(metrics_clock::now()), lock() {
+        wait.record(metrics_clock::now() - started);
+    }
+
+private:
+    metrics_clock::time_point started;
+    py::gil_scoped_acquire lock;
+};
+
+#endif // AIOPVXS_METRICS_HPP
@@ -25,6 +25,10 @@
 
 namespace py = pybind11;
 
+// defined in data.cpp
+py::object ndarray_image(const pvxs::Value& ndarray);
+void ndarray_set_image(pvxs::Value& ndarray, py::buffer data);
+void register_ndarray_codec(const std::string& name, py::object decoder);
 
 void create_submodule_nt(py::module_& m) {
     m.doc() = "Normative Type definitions";
@@ -41,4 +45,34 @@ void create_submodule_nt(py::module_& m) {
         .def("build", &NTEnum::build, "Turn TypeCode into TypeDef")
         .def("create", &NTEnum::create, "Turn TypeCode into empty Value");
 
+    py::class_<NTTable>(m, "NTTable", "EPICS V4 Normative Type that describes a table of typed columns")
+        .def(py::init<>(), "Default contructor")
+        .def(py::init([](const std::vector<std::pair<pvxs::TypeCode::code_t, std::string>>& columns) {
+            NTTable table;
+            for (auto& column : columns)
+                table.add_column(pvxs::TypeCode(column.first), column.second.c_str());
+            return table;
+        }), py::arg("columns"), "Initialise with list of (TypeCodeEnum, 'column name') tuples, "
+                                "with array TypeCodes (eg. Float64A)")
+        .def("add_column", [](NTTable& self, pvxs::TypeCode::code_t code, const std::string& name,
+                              const std::string& label) -> NTTable& {
+            return self.add_column(pvxs::TypeCode(code), name.c_str(), label.empty() ? nullptr : label.c_str());
+        }, py::arg("code"), py::arg("name"), py::arg("label") = "", py::return_value_policy::reference_internal,
+           "Add column with array TypeCodeEnum, name and label (defaults to name)")
+        .def("build", &NTTable::build, "Turn columns into TypeDef")
+        .def("create", &NTTable::create, "Turn columns into empty Value");
+
+    py::class_<NTNDArray>(m, "NTNDArray", "EPICS V4 Normative Type that describes an N-dimensional image")
+        .def(py::init<>(), "Default contructor")
+        .def("build", &NTNDArray::build, "Turn TypeCode into TypeDef")
+        .def("create", &NTNDArray::create, "Turn TypeCode into empty Value")
+        .def_static("image", &ndarray_image, py::arg("value"),
+                    "Return image data of NTNDArray Value as buffer shaped by its dimensions, "
+                    "decoding it with the registered codec if compressed")
+        .def_static("set_image", &ndarray_set_image, py::arg("value"), py::arg("data"),
+                    "Store C-contiguous buffer into NTNDArray Value, with dimensions from buffer shape")
+        .def_static("register_codec", &register_ndarray_codec, py::arg("name"), py::arg("decoder"),
+                    "Register decoder(data, value) returning a buffer of pixels for codec name, "
+                    "or remove it with None");
+
 }
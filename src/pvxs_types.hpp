@@ -18,6 +18,9 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
  */
 
+#include <mutex>
+#include <vector>
+
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
@@ -30,11 +33,101 @@ namespace pybind11 {
     PYBIND11_RUNTIME_EXCEPTION(stop_async_iteration, PyExc_StopAsyncIteration)
 }
 
+/*
+ * BufferReleaseQueue
+ *
+ * Python buffers adopted by shared_arrays, waiting to be released by a
+ * thread that holds the GIL. The last reference to a shared_array is often
+ * dropped on a pvxs worker thread that holds pvxs locks, while python
+ * threads holding the GIL take the same locks (eg. SharedPV.post()), so
+ * acquiring the GIL there could deadlock. Buffers are released from a
+ * python pending call, or by the next thread that adopts a buffer.
+ *
+ */
+class BufferReleaseQueue {
+public:
+    static BufferReleaseQueue& instance() {
+        // never destroyed, buffers might be released during interpreter shutdown
+        static auto queue = new BufferReleaseQueue();
+        return *queue;
+    }
+
+    // any thread, with or without the GIL
+    void release(py::buffer_info* view) {
+        if (PyGILState_Check()) {
+            delete view;
+            return;
+        }
+
+        bool schedule;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            pending.push_back(view);
+            schedule = !scheduled;
+            scheduled = true;
+        }
+        // if the pending call can not be added, the next adopt() releases the buffer
+        if (schedule && Py_AddPendingCall(&BufferReleaseQueue::drain_pending, nullptr) != 0) {
+            std::lock_guard<std::mutex> guard(lock);
+            scheduled = false;
+        }
+    }
+
+    // GIL must be held
+    void drain() {
+        std::vector<py::buffer_info*> views;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            views.swap(pending);
+            scheduled = false;
+        }
+        for (auto view : views)
+            delete view;
+    }
+
+private:
+    BufferReleaseQueue() : scheduled(false) {}
+
+    static int drain_pending(void*) {
+        instance().drain();
+        return 0;
+    }
+
+    std::mutex lock;
+    std::vector<py::buffer_info*> pending;
+    bool scheduled;
+};
+
 template <typename T>
-bool make_shared_array(const py::buffer_info& info, shared_array<const void>& sa) {
-    auto arr_begin = static_cast<const T*>(info.ptr);
-    auto arr_end = static_cast<const T*>(arr_begin + info.shape[0]);
-    sa = shared_array<const T>(arr_begin, arr_end).template castTo<const void>();
+bool make_shared_array(py::buffer_info&& info, shared_array<const void>& sa) {
+    const size_t count = static_cast<size_t>(info.shape[0]);
+    const py::ssize_t stride = info.strides[0];
+
+    // contents of a read-only, contiguous buffer can not change while it is
+    // exported, so the shared_array adopts its storage without a copy. The
+    // deleter owns the Py_buffer, which holds a reference to the exporting
+    // python object until the shared_array is released
+    if (info.readonly && stride == static_cast<py::ssize_t>(sizeof(T))) {
+        // GIL is held, release buffers dropped by other threads since
+        BufferReleaseQueue::instance().drain();
+
+        auto view = new py::buffer_info(std::move(info));
+        std::shared_ptr<const T> storage(static_cast<const T*>(view->ptr), [view](const T*) {
+            // last reference might be released on a pvxs worker thread
+            if (!Py_IsInitialized())
+                return;
+            BufferReleaseQueue::instance().release(view);
+        });
+        sa = shared_array<const T>(storage, count).template castTo<const void>();
+        return true;
+    }
+
+    // otherwise copy, buffer might be writable or strided
+    shared_array<T> new_value(count);
+    auto arr_begin = static_cast<const char*>(info.ptr);
+    for (size_t i = 0; i < count; i++)
+        new_value[i] = *reinterpret_cast<const T*>(arr_begin + static_cast<py::ssize_t>(i) * stride);
+    sa = freeze(std::move(new_value)).template castTo<const void>();
     return true;
 }
 
@@ -49,15 +142,22 @@ py::object make_python_array(const shared_array<const void>& sa) {
         {sizeof(T)}
     );
 
-    return array_array(py::format_descriptor<T>::format(), mv);
+    // array.frombytes() copies the whole buffer at once, passing the
+    // memoryview to the array.array() constructor copies item by item
+    py::object py_array = array_array(py::format_descriptor<T>::format());
+    py_array.attr("frombytes")(mv);
+    return py_array;
 }
 
 template <typename T>
 bool load_from_python_seq(const py::sequence src, shared_array<const void>& sa) {
     try {
-        auto seq_as_vector = src.cast<std::vector<T>>();
-        shared_array<const T> new_value(seq_as_vector.begin(), seq_as_vector.end());
-        sa = new_value.template castTo<const void>();
+        // cast each item directly into shared_array storage
+        shared_array<T> new_value(src.size());
+        size_t i = 0;
+        for (auto item : src)
+            new_value[i++] = item.cast<T>();
+        sa = freeze(std::move(new_value)).template castTo<const void>();
         return true;
     }
     catch (const std::exception& e) {
@@ -72,25 +172,25 @@ bool load_from_python_array(const py::buffer src, shared_array<const void>& sa)
     if (info.ndim != 1)
         return false;
     else if (info.item_type_is_equivalent_to<uint8_t>())
-        return make_shared_array<uint8_t>(info, sa);
+        return make_shared_array<uint8_t>(std::move(info), sa);
     else if (info.item_type_is_equivalent_to<uint16_t>())
-        return make_shared_array<uint16_t>(info, sa);
+        return make_shared_array<uint16_t>(std::move(info), sa);
     else if (info.item_type_is_equivalent_to<uint32_t>())
-        return make_shared_array<uint32_t>(info, sa);
+        return make_shared_array<uint32_t>(std::move(info), sa);
     else if (info.item_type_is_equivalent_to<uint64_t>())
-        return make_shared_array<uint64_t>(info, sa);
+        return make_shared_array<uint64_t>(std::move(info), sa);
     else if (info.item_type_is_equivalent_to<int8_t>())
-        return make_shared_array<int8_t>(info, sa);
+        return make_shared_array<int8_t>(std::move(info), sa);
     else if (info.item_type_is_equivalent_to<int16_t>())
-        return make_shared_array<int16_t>(info, sa);
+        return make_shared_array<int16_t>(std::move(info), sa);
     else if (info.item_type_is_equivalent_to<int32_t>())
-        return make_shared_array<int32_t>(info, sa);
+        return make_shared_array<int32_t>(std::move(info), sa);
     else if (info.item_type_is_equivalent_to<int64_t>())
-        return make_shared_array<int64_t>(info, sa);
+        return make_shared_array<int64_t>(std::move(info), sa);
     else if (info.item_type_is_equivalent_to<float>())
-        return make_shared_array<float>(info, sa);
+        return make_shared_array<float>(std::move(info), sa);
     else if (info.item_type_is_equivalent_to<double>())
-        return make_shared_array<double>(info, sa);
+        return make_shared_array<double>(std::move(info), sa);
     else
         throw std::runtime_error("Conversion not yet implemented.");
 }
@@ -126,6 +226,104 @@ py::object cast_to_python_array(const shared_array<const void>& sa) {
     }
 }
 
+/*
+ * ArrayBuffer
+ *
+ * Read-only view of the storage of a shared_array<const void>. Exposes the
+ * storage with the python buffer protocol without copying it. The view holds
+ * a reference to the shared_array, so the storage stays valid for as long as
+ * any memoryview or numpy array made from the view exists.
+ *
+ */
+class ArrayBuffer {
+public:
+    explicit ArrayBuffer(const shared_array<const void>& sa) : sa(sa) {
+        switch (sa.original_type()) {
+            case ArrayType::Bool:
+                set_format<bool>(); break;
+            case ArrayType::UInt8:
+                set_format<uint8_t>(); break;
+            case ArrayType::UInt16:
+                set_format<uint16_t>(); break;
+            case ArrayType::UInt32:
+                set_format<uint32_t>(); break;
+            case ArrayType::UInt64:
+                set_format<uint64_t>(); break;
+            case ArrayType::Int8:
+                set_format<int8_t>(); break;
+            case ArrayType::Int16:
+                set_format<int16_t>(); break;
+            case ArrayType::Int32:
+                set_format<int32_t>(); break;
+            case ArrayType::Int64:
+                set_format<int64_t>(); break;
+            case ArrayType::Float32:
+                set_format<float>(); break;
+            case ArrayType::Float64:
+                set_format<double>(); break;
+            default:
+                throw py::type_error("Array type has no buffer representation");
+        }
+    }
+
+    size_t size() const { return sa.size(); }
+    size_t itemsize() const { return item_size; }
+    const std::string& format() const { return item_format; }
+
+    std::vector<py::ssize_t> shape() const {
+        if (dims.empty())
+            return {static_cast<py::ssize_t>(sa.size())};
+        return dims;
+    }
+
+    // view the storage as a C-contiguous multi-dimensional array
+    void reshape(const std::vector<py::ssize_t>& new_dims) {
+        py::ssize_t count = 1;
+        for (auto dim : new_dims)
+            count *= dim;
+        if (new_dims.empty() || count != static_cast<py::ssize_t>(sa.size()))
+            throw py::value_error("Shape does not match number of array elements");
+        dims = new_dims;
+    }
+
+    py::buffer_info buffer() const {
+        // empty arrays may not have any storage, but a buffer must not be NULL
+        static const char empty = 0;
+        const void* ptr = sa.data() ? sa.data() : &empty;
+
+        auto buffer_shape = shape();
+        std::vector<py::ssize_t> strides(buffer_shape.size());
+        py::ssize_t stride = static_cast<py::ssize_t>(item_size);
+        for (size_t i = buffer_shape.size(); i-- > 0;) {
+            strides[i] = stride;
+            stride *= buffer_shape[i];
+        }
+
+        return py::buffer_info(
+            const_cast<void*>(ptr),
+            static_cast<py::ssize_t>(item_size),
+            item_format,
+            static_cast<py::ssize_t>(buffer_shape.size()),
+            buffer_shape,
+            strides,
+            true    // readonly
+        );
+    }
+
+private:
+    template <typename T>
+    void set_format() {
+        item_size = sizeof(T);
+        item_format = py::format_descriptor<T>::format();
+    }
+
+    shared_array<const void> sa;
+    size_t item_size;
+    std::string item_format;
+    // empty for 1-D view
+    std::vector<py::ssize_t> dims;
+};
+
 namespace pybind11 {
 namespace detail {
 
@@ -152,7 +350,7 @@ struct type_caster<shared_array<const void>> {
     bool load(handle src, bool convert) {
         // check if py_object is a buffer
         if (py::isinstance<py::buffer>(src)) {
-            // inspect data type of python array and copy-construct new shared_array
+            // inspect data type of python array, adopt (read-only) or copy into new shared_array
             py::buffer src_buffer = py::reinterpret_borrow<py::buffer>(src);
             return load_from_python_array(src_buffer, value);
         }
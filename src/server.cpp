@@ -18,6 +18,16 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include <pybind11/functional.h>
@@ -25,8 +35,745 @@
 #include <pvxs/server.h>
 #include <pvxs/sharedpv.h>
 
+#include "metrics.hpp"
+
 namespace py = pybind11;
 
+// defined in data.cpp
+void assign_dict(pvxs::Value& value, py::dict values_dict);
+
+/*
+ * ProcessStats
+ *
+ * Runtime metrics of the SharedPV handlers and posts of the whole process,
+ * returned by server.process_stats(). A SharedPV can be served by several
+ * Servers, and an ExecOp does not tell which Server it came from, so these
+ * can not be counted per Server. Updated without a lock from pvxs worker
+ * threads and python.
+ *
+ */
+struct ProcessStats {
+    ProcessStats() : posts(0) {}
+
+    static ProcessStats& instance() {
+        // never destroyed, last handlers might finish during interpreter shutdown
+        static auto stats = new ProcessStats();
+        return *stats;
+    }
+
+    py::dict to_python() const {
+        py::dict py_stats;
+        py_stats["put"] = put.to_python();
+        py_stats["rpc"] = rpc.to_python();
+        py_stats["posts"] = posts.load(std::memory_order_relaxed);
+        py_stats["gil_wait"] = gil_wait.to_python();
+        return py_stats;
+    }
+
+    void prometheus(std::ostream& out, const std::string& prefix) const {
+        prometheus_ops(out, prefix, {{"put", &put}, {"rpc", &rpc}});
+        prometheus_metric(out, prefix + "_posts_total", "counter", posts.load(std::memory_order_relaxed));
+        out << "# TYPE " << prefix << "_gil_wait_seconds histogram\n";
+        gil_wait.prometheus(out, prefix + "_gil_wait_seconds", "");
+    }
+
+    void reset() {
+        put.reset();
+        rpc.reset();
+        posts.store(0, std::memory_order_relaxed);
+        gil_wait.reset();
+    }
+
+    // onPut/onRPC requests, from handler dispatch until reply() or error()
+    OpCounters put, rpc;
+    // SharedPV.post() and post_many() updates
+    std::atomic<uint64_t> posts;
+    // time pvxs worker threads waited for the GIL to run handlers
+    LatencyHistogram gil_wait;
+};
+
+/*
+ * ConnectionTotals
+ *
+ * Client connections, channels and bytes sent and received of one Server,
+ * summed from its report. GIL must be held, it is released while the report
+ * is collected.
+ *
+ */
+struct ConnectionTotals {
+    size_t connections = 0, channels = 0, tx = 0, rx = 0;
+
+    static ConnectionTotals of(pvxs::server::Server& server) {
+        ConnectionTotals totals;
+        py::gil_scoped_release nogil;
+        auto report = server.report(false);
+        for (auto& conn : report.connections) {
+            totals.connections++;
+            totals.channels += conn.channels.size();
+            totals.tx += conn.tx;
+            totals.rx += conn.rx;
+        }
+        return totals;
+    }
+};
+
+/*
+ * shared_pv_update
+ *
+ * Casts python Value or dictionary to an update of the data type of an open
+ * SharedPV. GIL must be held.
+ *
+ */
+inline pvxs::Value
+shared_pv_update(pvxs::server::SharedPV& pv, py::handle data) {
+    if (py::isinstance<py::dict>(data)) {
+        auto value = pv.fetch().cloneEmpty();
+        assign_dict(value, py::reinterpret_borrow<py::dict>(data));
+        return value;
+    }
+    return data.cast<pvxs::Value>();
+}
+
+/*
+ * post_many
+ *
+ * Casts every update of a python dictionary {SharedPV or 'name': Value or
+ * dictionary} with GIL held, then releases the GIL once to post all of them,
+ * so subscribers of every PV see the updates at nearly the same time. Names
+ * are looked up in pvs. Nothing is posted if any update can not be cast.
+ *
+ */
+inline void
+post_many(py::dict updates, const std::map<std::string, pvxs::server::SharedPV>& pvs) {
+    using pvxs::server::SharedPV;
+
+    std::vector<std::pair<SharedPV, pvxs::Value>> posts;
+    posts.reserve(py::len(updates));
+    for (auto item : updates) {
+        SharedPV pv;
+        if (py::isinstance<py::str>(item.first)) {
+            auto it = pvs.find(item.first.cast<std::string>());
+            if (it == pvs.end())
+                throw py::key_error("No SharedPV named '" + item.first.cast<std::string>() + "'");
+            pv = it->second;
+        }
+        else {
+            pv = item.first.cast<SharedPV>();
+        }
+        auto value = shared_pv_update(pv, item.second);
+        posts.emplace_back(pv, value);
+    }
+
+    ProcessStats::instance().posts.fetch_add(posts.size(), std::memory_order_relaxed);
+    py::gil_scoped_release nogil;
+    for (auto& post : posts)
+        post.first.post(post.second);
+}
+
+/*
+ * ServerOp
+ *
+ * Owns the pvxs::server::ExecOp of a PUT or RPC request while python handles
+ * it, and remembers if it was completed with reply() or error(), so handlers
+ * that are async def functions can be completed automatically when they end.
+ * The time from dispatch until completion is counted in ProcessStats.
+ *
+ */
+class ServerOp {
+public:
+    ServerOp(std::unique_ptr<pvxs::server::ExecOp>&& op, OpCounters& counters)
+        : op(std::move(op)), counters(&counters), started(counters.start()) {}
+    ServerOp(ServerOp&&) = default;
+
+    ~ServerOp() {
+        // dropped without reply, pvxs reports an error to the client
+        if (op) {
+            counters->fail();
+            counters->finish(started);
+        }
+    }
+
+    void reply() { complete()->reply(); }
+    void reply(const pvxs::Value& value) { complete()->reply(value); }
+    void error(const std::string& msg) {
+        auto failed = complete();
+        counters->fail();
+        failed->error(msg);
+    }
+
+    bool done() const { return !op; }
+
+private:
+    std::unique_ptr<pvxs::server::ExecOp> complete() {
+        if (!op)
+            throw std::logic_error("Operation has already been completed");
+        counters->finish(started);
+        return std::move(op);
+    }
+
+    std::unique_ptr<pvxs::server::ExecOp> op;
+    OpCounters* counters;
+    metrics_clock::time_point started;
+};
+
+/*
+ * PyHandler
+ *
+ * Python onPut/onRPC handler, with the asyncio event loop or executor it is
+ * dispatched to, and the asyncio.Semaphore that limits how many async def
+ * handlers run at once. Held by a std::function<> in the SharedPV, so the
+ * last reference might be released on a pvxs worker thread.
+ *
+ */
+struct PyHandler {
+    PyHandler(py::object handler, py::object loop, py::object executor, py::object limit,
+              py::object task_loop)
+        : handler(handler), loop(loop), executor(executor), limit(limit), task_loop(task_loop) {}
+
+    ~PyHandler() {
+        if (!Py_IsInitialized()) {
+            handler.release();
+            loop.release();
+            executor.release();
+            limit.release();
+            task_loop.release();
+            return;
+        }
+        py::gil_scoped_acquire lock;
+        handler = py::object();
+        loop = py::object();
+        executor = py::object();
+        limit = py::object();
+        task_loop = py::object();
+    }
+
+    py::object handler;
+    py::object loop;
+    py::object executor;
+    py::object limit;
+    // event loop that runs async def handlers
+    py::object task_loop;
+};
+
+/*
+ * complete_handler
+ *
+ * Completes the operation of an async def handler once its task is done,
+ * unless the handler already did. The result of the handler (a Value) is the
+ * reply, an exception raised by the handler is the error.
+ *
+ */
+inline void
+complete_handler(ServerOp& op, py::object task) {
+    if (op.done())
+        return;
+
+    if (task.attr("cancelled")().cast<bool>())
+        op.error("Handler cancelled");
+    else if (!task.attr("exception")().is_none())
+        op.error(py::str(task.attr("exception")()));
+    else if (py::isinstance<pvxs::Value>(task.attr("result")()))
+        op.reply(task.attr("result")().cast<pvxs::Value>());
+    else
+        op.reply();
+}
+
+/*
+ * run_handler
+ *
+ * Calls python handler with (SharedPV, ExecOp, Value). If it returns an
+ * awaitable (ie. it is an async def function), it is scheduled as a task on
+ * the asyncio event loop, after acquiring limit (if not None), and the
+ * operation is completed when the task is done. When called on another
+ * thread (a pvxs worker or executor), the task is handed over to the event
+ * loop with loop.call_soon_threadsafe(). Without an event loop, the
+ * awaitable is closed and the operation fails. Exceptions raised by other
+ * handlers are reported to the client with ExecOp.error(). Must be called
+ * with GIL held.
+ *
+ */
+inline void
+run_handler(py::object handler, py::object loop, py::object limit,
+            py::object pv, py::object op, py::object value) {
+    auto op_error = [op](const std::string& msg) {
+        try {
+            ServerOp& server_op = op.cast<ServerOp&>();
+            if (!server_op.done())
+                server_op.error(msg);
+        }
+        catch (py::error_already_set& e) {
+            e.discard_as_unraisable("SharedPV handler");
+        }
+    };
+
+    try {
+        py::object result = handler(pv, op, value);
+        if (!py::module_::import("inspect").attr("isawaitable")(result).cast<bool>())
+            return;
+
+        if (loop.is_none()) {
+            // never awaited, close it so python does not warn about it
+            if (py::hasattr(result, "close"))
+                result.attr("close")();
+            op_error("Handler returned an awaitable, but has no event loop to run it on");
+            return;
+        }
+
+        py::module_ asyncio = py::module_::import("asyncio");
+
+        // handler task releases limit and completes operation when done
+        auto start = [asyncio, loop, limit, op](py::object coro) {
+            py::object task = asyncio.attr("ensure_future")(coro, py::arg("loop") = loop);
+            task.attr("add_done_callback")(py::cpp_function([limit, op](py::object task) {
+                if (!limit.is_none())
+                    limit.attr("release")();
+                complete_handler(op.cast<ServerOp&>(), task);
+            }));
+        };
+
+        // runs on the event loop
+        auto schedule = [asyncio, loop, limit, start, result, op_error]() {
+            if (limit.is_none()) {
+                start(result);
+                return;
+            }
+
+            // excess requests wait here, in the order they arrived
+            py::object acquire = asyncio.attr("ensure_future")(limit.attr("acquire")(), py::arg("loop") = loop);
+            acquire.attr("add_done_callback")(py::cpp_function([start, result, op_error](py::object acquire) {
+                if (acquire.attr("cancelled")().cast<bool>()) {
+                    if (py::hasattr(result, "close"))
+                        result.attr("close")();
+                    op_error("Handler cancelled");
+                    return;
+                }
+                start(result);
+            }));
+        };
+
+        if (asyncio.attr("_get_running_loop")().is(loop))
+            schedule();
+        else
+            loop.attr("call_soon_threadsafe")(py::cpp_function(schedule));
+    }
+    catch (py::error_already_set& e) {
+        op_error(e.what());
+    }
+}
+
+/*
+ * dispatch_handler
+ *
+ * Returns a std::function<> that can be used as SharedPV onPut/onRPC handler.
+ * Without loop or executor, the python handler runs on the pvxs worker thread.
+ * Otherwise the GIL is only held long enough to hand the request over to the
+ * asyncio event loop (loop.call_soon_threadsafe()) or to the executor
+ * (executor.submit()), so a slow handler does not hold up the pvxs worker.
+ *
+ */
+inline std::function<void(pvxs::server::SharedPV&, std::unique_ptr<pvxs::server::ExecOp>&&, pvxs::Value&&)>
+dispatch_handler(py::object handler, py::object loop, py::object executor,
+                 size_t max_in_flight, py::object limit, OpCounters ProcessStats::*kind) {
+    using namespace pvxs::server;
+
+    if (!loop.is_none() && !executor.is_none())
+        throw py::value_error("Handler can be dispatched to an event loop or an executor, not both");
+    if (max_in_flight > 0 && !limit.is_none())
+        throw py::value_error("Use either max_in_flight or limit, not both");
+    if (max_in_flight > 0)
+        limit = py::module_::import("asyncio").attr("Semaphore")(max_in_flight);
+
+    // pvxs worker and executor threads have no event loop, async def handlers
+    // run on the one that is running now
+    py::object task_loop = loop;
+    if (loop.is_none()) {
+        task_loop = py::module_::import("asyncio").attr("_get_running_loop")();
+        if (task_loop.is_none() && py::module_::import("inspect").attr("iscoroutinefunction")(handler).cast<bool>())
+            throw py::value_error("async def handler needs an event loop, pass loop= or install it "
+                                  "while the event loop it runs on is running");
+    }
+
+    auto py_handler = std::make_shared<PyHandler>(handler, loop, executor, limit, task_loop);
+    return [py_handler, kind](SharedPV& pv, std::unique_ptr<ExecOp>&& op, pvxs::Value&& value) {
+        auto& stats = ProcessStats::instance();
+        timed_gil_acquire lock(stats.gil_wait);
+        try {
+            // python takes ownership of ExecOp, it can reply after returning
+            py::object py_pv = py::cast(SharedPV(pv));
+            py::object py_op = py::cast(ServerOp(std::move(op), stats.*kind));
+            py::object py_value = py::cast(std::move(value));
+            py::cpp_function run(&run_handler);
+
+            if (!py_handler->executor.is_none())
+                py_handler->executor.attr("submit")(run, py_handler->handler, py_handler->task_loop,
+                                                    py_handler->limit, py_pv, py_op, py_value);
+            else if (!py_handler->loop.is_none())
+                py_handler->loop.attr("call_soon_threadsafe")(run, py_handler->handler, py_handler->loop,
+                                                             py_handler->limit, py_pv, py_op, py_value);
+            else
+                run_handler(py_handler->handler, py_handler->task_loop, py_handler->limit,
+                            py_pv, py_op, py_value);
+        }
+        catch (py::error_already_set& e) {
+            e.discard_as_unraisable("SharedPV handler dispatch");
+        }
+    };
+}
+
+/*
+ * connect_hook
+ *
+ * Returns a std::function<> that can be used as SharedPV onFirstConnect or
+ * onLastDisconnect callback. It calls python hook(SharedPV) on the pvxs
+ * worker thread with GIL held.
+ *
+ */
+inline std::function<void(pvxs::server::SharedPV&)>
+connect_hook(py::object hook) {
+    using pvxs::server::SharedPV;
+
+    auto py_hook = std::make_shared<PyHandler>(hook, py::none(), py::none(), py::none(), py::none());
+    return [py_hook](SharedPV& pv) {
+        if (!Py_IsInitialized())
+            return;
+        py::gil_scoped_acquire lock;
+        try {
+            py_hook->handler(SharedPV(pv));
+        }
+        catch (py::error_already_set& e) {
+            e.discard_as_unraisable("SharedPV connect hook");
+        }
+    };
+}
+
+/*
+ * DynamicSource
+ *
+ * Server Source for large or generated PV populations. Searches are answered
+ * from a C++ index of name prefixes and exact names, without the GIL. A
+ * SharedPV is only created when a client first connects to a name, either
+ * from a prototype Value or by the python on_create(name) hook, and is
+ * closed and forgotten once it has had no clients for idle_timeout seconds.
+ * Idle PVs are swept by a background thread every idle_timeout / 2 seconds,
+ * which is started with the first PV and exits with the DynamicSource.
+ *
+ */
+class DynamicSource : public pvxs::server::Source,
+                      public std::enable_shared_from_this<DynamicSource> {
+public:
+    DynamicSource(const std::vector<std::string>& prefixes, const std::vector<std::string>& names,
+                  const pvxs::Value& prototype, py::object on_create, py::object on_evict,
+                  double idle_timeout)
+        : prefixes(prefixes), names(names.begin(), names.end()), prototype(prototype),
+          on_create(on_create), on_evict(on_evict),
+          has_on_create(!on_create.is_none()), has_on_evict(!on_evict.is_none()),
+          idle_timeout(std::chrono::duration<double>(idle_timeout)), next_id(0) {}
+
+    ~DynamicSource() {
+        if (timer) {
+            std::lock_guard<std::mutex> guard(timer->lock);
+            timer->stop = true;
+            timer->wakeup.notify_all();
+        }
+
+        // last reference might be released on a pvxs worker thread
+        if (!Py_IsInitialized()) {
+            on_create.release();
+            on_evict.release();
+            return;
+        }
+        py::gil_scoped_acquire lock;
+        on_create = py::object();
+        on_evict = py::object();
+    }
+
+    void add_prefix(const std::string& prefix) {
+        std::lock_guard<std::mutex> guard(lock);
+        prefixes.push_back(prefix);
+    }
+
+    void add_name(const std::string& name) {
+        std::lock_guard<std::mutex> guard(lock);
+        names.insert(name);
+    }
+
+    // names of PVs created so far, and not yet evicted
+    std::vector<std::string> list() {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<std::string> pv_names;
+        for (auto& entry : pvs)
+            pv_names.push_back(entry.first);
+        return pv_names;
+    }
+
+    // close PVs that have been without clients for idle_timeout, GIL must not be held
+    size_t sweep() {
+        std::vector<std::pair<std::string, pvxs::server::SharedPV>> evicted;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto now = std::chrono::steady_clock::now();
+            for (auto it = pvs.begin(); it != pvs.end();) {
+                // PVs a client is being attached to are kept
+                if (it->second.idle && it->second.attaching == 0 && now - it->second.idle_since >= idle_timeout) {
+                    evicted.emplace_back(it->first, it->second.pv);
+                    it = pvs.erase(it);
+                }
+                else {
+                    ++it;
+                }
+            }
+        }
+
+        // SharedPV callbacks might need the lock
+        for (auto& pv : evicted)
+            pv.second.close();
+
+        if (has_on_evict && !evicted.empty() && Py_IsInitialized()) {
+            py::gil_scoped_acquire gil;
+            for (auto& pv : evicted) {
+                try {
+                    on_evict(pv.first, pv.second);
+                }
+                catch (py::error_already_set& e) {
+                    e.discard_as_unraisable("DynamicSource on_evict");
+                }
+            }
+        }
+        return evicted.size();
+    }
+
+    // pvxs::server::Source interface, called on pvxs worker threads
+
+    void onSearch(Search& op) override {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto& name : op) {
+            if (matches(name.name()))
+                name.claim();
+        }
+    }
+
+    void onCreate(std::unique_ptr<pvxs::server::ChannelControl>&& chan) override {
+        using pvxs::server::SharedPV;
+
+        std::string name(chan->name());
+        SharedPV pv;
+        uint64_t id = 0;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!matches(name))
+                return;
+            auto it = pvs.find(name);
+            if (it != pvs.end()) {
+                pv = it->second.pv;
+                id = it->second.id;
+                it->second.attaching++;
+            }
+        }
+
+        if (!pv) {
+            // not holding the lock, on_create() needs the GIL
+            Hooks user_hooks;
+            pv = create(name, user_hooks);
+            // returning without attaching rejects the channel
+            if (!pv)
+                return;
+
+            std::lock_guard<std::mutex> guard(lock);
+            auto inserted = pvs.emplace(name, Entry(pv, next_id));
+            if (!inserted.second) {
+                // created by another client meanwhile
+                pv = inserted.first->second.pv;
+            }
+            else {
+                next_id++;
+                watch(pv, name, inserted.first->second.id, user_hooks);
+            }
+            id = inserted.first->second.id;
+            inserted.first->second.attaching++;
+        }
+
+        // not holding the lock, attach() might call the onFirstConnect hook.
+        // sweep() skips the entry until the channel is attached
+        try {
+            pv.attach(std::move(chan));
+        }
+        catch (...) {
+            attached(name, id);
+            throw;
+        }
+        attached(name, id);
+    }
+
+    List onList() override {
+        List list;
+        auto pv_names = std::make_shared<std::set<std::string>>();
+        for (auto& name : this->list())
+            pv_names->insert(name);
+        list.names = pv_names;
+        list.dynamic = true;
+        return list;
+    }
+
+private:
+    struct Entry {
+        Entry(const pvxs::server::SharedPV& pv, uint64_t id) : pv(pv), id(id), attaching(0), idle(false) {}
+
+        pvxs::server::SharedPV pv;
+        // tells apart PVs created for the same name before and after an eviction
+        uint64_t id;
+        // clients between lookup and attach() in onCreate()
+        size_t attaching;
+        bool idle;
+        std::chrono::steady_clock::time_point idle_since;
+    };
+
+    // lock must be held
+    bool matches(const std::string& name) const {
+        if (names.count(name))
+            return true;
+        for (auto& prefix : prefixes) {
+            if (name.compare(0, prefix.size(), prefix) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    // onFirstConnect and onLastDisconnect hooks installed by the user
+    struct Hooks {
+        std::function<void(pvxs::server::SharedPV&)> first_connect;
+        std::function<void(pvxs::server::SharedPV&)> last_disconnect;
+    };
+
+    pvxs::server::SharedPV create(const std::string& name, Hooks& user_hooks) {
+        using pvxs::server::SharedPV;
+
+        if (!has_on_create) {
+            auto pv = SharedPV::buildMailbox();
+            pv.open(prototype.clone());
+            return pv;
+        }
+
+        py::gil_scoped_acquire gil;
+        try {
+            py::object result = on_create(name);
+            if (result.is_none())
+                return SharedPV();
+            else if (py::isinstance<SharedPV>(result)) {
+                // pvxs can not return installed hooks, the python ones are kept on the object
+                if (py::hasattr(result, "_on_first_connect"))
+                    user_hooks.first_connect = connect_hook(result.attr("_on_first_connect"));
+                if (py::hasattr(result, "_on_last_disconnect"))
+                    user_hooks.last_disconnect = connect_hook(result.attr("_on_last_disconnect"));
+                return result.cast<SharedPV>();
+            }
+
+            auto pv = SharedPV::buildMailbox();
+            pv.open(result.cast<pvxs::Value>());
+            return pv;
+        }
+        catch (py::error_already_set& e) {
+            e.discard_as_unraisable("DynamicSource on_create");
+        }
+        catch (const std::exception& exc) {
+            py::print("C++ exception thrown in DynamicSource on_create:", exc.what());
+        }
+        return SharedPV();
+    }
+
+    // lock must be held
+    void watch(pvxs::server::SharedPV& pv, const std::string& name, uint64_t id, const Hooks& user_hooks) {
+        using pvxs::server::SharedPV;
+
+        // weak reference, the source owns its PVs. Hooks of the user are
+        // replaced, so they are called from here. id keeps hooks of an
+        // evicted PV from changing the entry of a new PV with the same name
+        std::weak_ptr<DynamicSource> weak_src(shared_from_this());
+        auto first_connect = user_hooks.first_connect;
+        pv.onFirstConnect([weak_src, name, id, first_connect](SharedPV& pv) {
+            if (auto src = weak_src.lock())
+                src->set_idle(name, id, false);
+            if (first_connect)
+                first_connect(pv);
+        });
+        auto last_disconnect = user_hooks.last_disconnect;
+        pv.onLastDisconnect([weak_src, name, id, last_disconnect](SharedPV& pv) {
+            if (auto src = weak_src.lock())
+                src->set_idle(name, id, true);
+            if (last_disconnect)
+                last_disconnect(pv);
+        });
+
+        if (idle_timeout.count() > 0 && !timer)
+            start_timer();
+    }
+
+    // lock must be held
+    void start_timer() {
+        timer = std::make_shared<SweepTimer>();
+        auto period = std::max(std::chrono::duration_cast<std::chrono::steady_clock::duration>(idle_timeout / 2),
+                               std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                   std::chrono::milliseconds(10)));
+
+        // weak reference, the thread is detached and stops once the source is gone
+        std::weak_ptr<DynamicSource> weak_src(shared_from_this());
+        std::shared_ptr<SweepTimer> sweep_timer(timer);
+        std::thread([weak_src, sweep_timer, period]() {
+            std::unique_lock<std::mutex> guard(sweep_timer->lock);
+            while (!sweep_timer->wakeup.wait_for(guard, period, [&sweep_timer]() { return sweep_timer->stop; })) {
+                guard.unlock();
+                {
+                    auto src = weak_src.lock();
+                    if (!src)
+                        return;
+                    src->sweep();
+                }
+                guard.lock();
+            }
+        }).detach();
+    }
+
+    // end of attach() in onCreate()
+    void attached(const std::string& name, uint64_t id) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = pvs.find(name);
+        if (it != pvs.end() && it->second.id == id)
+            it->second.attaching--;
+    }
+
+    void set_idle(const std::string& name, uint64_t id, bool idle) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = pvs.find(name);
+        if (it == pvs.end() || it->second.id != id)
+            return;
+        it->second.idle = idle;
+        it->second.idle_since = std::chrono::steady_clock::now();
+    }
+
+    std::mutex lock;
+    std::vector<std::string> prefixes;
+    std::unordered_set<std::string> names;
+    std::unordered_map<std::string, Entry> pvs;
+
+    const pvxs::Value prototype;
+    py::object on_create;
+    py::object on_evict;
+    const bool has_on_create;
+    const bool has_on_evict;
+    const std::chrono::duration<double> idle_timeout;
+    // id of the next PV created, lock must be held
+    uint64_t next_id;
+
+    // wakes up the sweep thread early when the source is destroyed
+    struct SweepTimer {
+        SweepTimer() : stop(false) {}
+
+        std::mutex lock;
+        std::condition_variable wakeup;
+        bool stop;
+    };
+    std::shared_ptr<SweepTimer> timer;
+};
+
 
 void create_submodule_server(py::module_& m) {
     m.doc() = "PVAccess Server API";
@@ -34,10 +781,11 @@ void create_submodule_server(py::module_& m) {
     using namespace pvxs;
     using namespace pvxs::server;
 
-    py::class_<ExecOp>(m, "ExecOp", "Handle for server-side operation on a PV.")
-        .def("reply", static_cast<void (ExecOp::*)()>(&ExecOp::reply), "Issue a reply without data")
-        .def("reply", static_cast<void (ExecOp::*)(const Value&)>(&ExecOp::reply), "Issue a reply with data")
-        .def("error", &ExecOp::error, "Indicate the request has resulted in an error");
+    py::class_<ServerOp>(m, "ExecOp", "Handle for server-side operation on a PV.")
+        .def("reply", static_cast<void (ServerOp::*)()>(&ServerOp::reply), "Issue a reply without data")
+        .def("reply", static_cast<void (ServerOp::*)(const Value&)>(&ServerOp::reply), "Issue a reply with data")
+        .def("error", &ServerOp::error, "Indicate the request has resulted in an error")
+        .def_property_readonly("done", &ServerOp::done, "True once reply() or error() was called");
 
     py::class_<StaticSource>(m, "StaticSource", "Associate SharedPV instances with a name")
 
@@ -53,9 +801,43 @@ void create_submodule_server(py::module_& m) {
         // class methods
         .def("add", &StaticSource::add, "Add SharedPV by name")
         .def("remove", &StaticSource::remove, "Remove SharedPV by name")
-        .def("list", &StaticSource::list, "Returns dictionary of {'name': SharedPV}");
+        .def("list", &StaticSource::list, "Returns dictionary of {'name': SharedPV}")
+        .def("post_many", [](StaticSource& self, py::dict updates) {
+            post_many(updates, self.list());
+        }, py::arg("updates"), "Update the cached values of several SharedPVs at once from a dictionary "
+                               "of {'name' or SharedPV: Value or python dictionary}");
+
+    py::class_<DynamicSource, py::smart_holder>(m, "DynamicSource", "Create SharedPV instances on demand for names "
+                                                                   "matching a prefix or list of names")
+
+        // constructors
+        .def(py::init([](const std::vector<std::string>& prefixes, const std::vector<std::string>& names,
+                         py::object prototype, py::object on_create, py::object on_evict, double idle_timeout) {
+            if (prototype.is_none() && on_create.is_none())
+                throw py::value_error("DynamicSource needs a prototype Value or an on_create function");
 
-    py::class_<SharedPV>(m, "SharedPV", "Process variable (PV) data that can be accessed via Server")
+            Value proto;
+            if (!prototype.is_none())
+                proto = prototype.cast<Value>();
+            return std::make_shared<DynamicSource>(prefixes, names, proto, on_create, on_evict, idle_timeout);
+        }), py::arg("prefixes") = std::vector<std::string>(), py::arg("names") = std::vector<std::string>(),
+            py::arg("prototype") = py::none(), py::arg("on_create") = py::none(), py::arg("on_evict") = py::none(),
+            py::arg("idle_timeout") = 0.0,
+            "Initialise DynamicSource serving every name in names or starting with one of prefixes. "
+            "A SharedPV is created when a client first connects, opened with a copy of prototype, "
+            "or returned by on_create(name) as SharedPV or Value (None rejects the client). PVs "
+            "without clients for idle_timeout seconds are closed by a background thread and "
+            "on_evict(name, SharedPV) is called")
+
+        // class methods
+        .def("add_prefix", &DynamicSource::add_prefix, "Serve every name starting with prefix")
+        .def("add_name", &DynamicSource::add_name, "Serve name")
+        .def("list", &DynamicSource::list, "Returns list of names of SharedPVs currently created")
+        .def("sweep", &DynamicSource::sweep, py::call_guard<py::gil_scoped_release>(),
+                      "Close SharedPVs that have been idle for idle_timeout now, instead of waiting for "
+                      "the background thread, returns number closed");
+
+    py::class_<SharedPV>(m, "SharedPV", py::dynamic_attr(), "Process variable (PV) data that can be accessed via Server")
 
         // constructors
         .def(py::init(&SharedPV::buildMailbox), "Initialise writable SharedPV")
@@ -78,11 +860,50 @@ void create_submodule_server(py::module_& m) {
  
         // class methods
         .def("open", &SharedPV::open, "Infer data type from initial value to SharedPV")
-        .def("close", &SharedPV::close, "Disconnects any active clients of SharedPV")
-        .def("post", &SharedPV::post, "Update the cached value of SharedPV")
+        .def("close", &SharedPV::close, py::call_guard<py::gil_scoped_release>(),
+                      "Disconnects any active clients of SharedPV")
+        .def("post", [](SharedPV& self, const Value& value) {
+            ProcessStats::instance().posts.fetch_add(1, std::memory_order_relaxed);
+            self.post(value);
+        }, "Update the cached value of SharedPV")
+        .def("post", [](SharedPV& self, py::dict values_dict) {
+            ProcessStats::instance().posts.fetch_add(1, std::memory_order_relaxed);
+            // cast python dictionary to the data type of the open SharedPV
+            self.post(shared_pv_update(self, values_dict));
+        }, "Cast python dictionary to data type of SharedPV and update the cached value")
+        .def_static("post_many", [](py::dict updates) {
+            post_many(updates, std::map<std::string, SharedPV>());
+        }, py::arg("updates"), "Update the cached values of several SharedPVs at once from a dictionary "
+                               "of {SharedPV: Value or python dictionary}")
 
-        .def("onPut", &SharedPV::onPut, "Install a custom callback function for PUT operations on this PV.")
-        .def("onRPC", &SharedPV::onRPC, "Install a custom callback function for RPC operations on this PV.");
+        .def("onPut", [](SharedPV& self, py::function handler, py::object loop, py::object executor,
+                         size_t max_in_flight, py::object limit) {
+            self.onPut(dispatch_handler(handler, loop, executor, max_in_flight, limit, &ProcessStats::put));
+        }, py::arg("handler"), py::arg("loop") = py::none(), py::arg("executor") = py::none(),
+           py::arg("max_in_flight") = 0, py::arg("limit") = py::none(),
+           "Install a custom callback function for PUT operations on this PV. It runs on "
+           "the pvxs worker thread, or on the asyncio event loop or executor if given. An "
+           "async def callback is scheduled as a task on the event loop, and the operation is "
+           "completed when it returns (reply with the returned Value) or raises (error). At most "
+           "max_in_flight async def callbacks run at once, or limit is an asyncio.Semaphore "
+           "shared by several PVs. Excess requests wait in order.")
+        .def("onRPC", [](SharedPV& self, py::function handler, py::object loop, py::object executor,
+                         size_t max_in_flight, py::object limit) {
+            self.onRPC(dispatch_handler(handler, loop, executor, max_in_flight, limit, &ProcessStats::rpc));
+        }, py::arg("handler"), py::arg("loop") = py::none(), py::arg("executor") = py::none(),
+           py::arg("max_in_flight") = 0, py::arg("limit") = py::none(),
+           "Install a custom callback function for RPC operations on this PV. It runs on "
+           "the pvxs worker thread, or on the asyncio event loop or executor if given. An "
+           "async def callback is scheduled as a task on the event loop and completed as for onPut().")
+        .def("onFirstConnect", [](py::object self, py::function hook) {
+            // kept on the object, so a DynamicSource can chain to it
+            self.attr("_on_first_connect") = hook;
+            self.cast<SharedPV&>().onFirstConnect(connect_hook(hook));
+        }, py::arg("hook"), "Install a callback function hook(SharedPV) run when the first client connects")
+        .def("onLastDisconnect", [](py::object self, py::function hook) {
+            self.attr("_on_last_disconnect") = hook;
+            self.cast<SharedPV&>().onLastDisconnect(connect_hook(hook));
+        }, py::arg("hook"), "Install a callback function hook(SharedPV) run when the last client disconnects");
 
     py::class_<Server>(m, "Server", "PVAccess protocol server")
 
@@ -99,11 +920,40 @@ void create_submodule_server(py::module_& m) {
         }), py::arg("provider"), "Initialize a Server with dictionary of SharedPVs")
 
         // class methods
+        .def("addSource", [](Server& self, const std::string& name, std::shared_ptr<DynamicSource> src, int order) {
+            self.addSource(name, src, order);
+        }, py::arg("name"), py::arg("source"), py::arg("order") = 0,
+           "Add DynamicSource, sources with lower order are searched first")
+        .def("addSource", [](Server& self, const std::string& name, StaticSource& src, int order) {
+            self.addSource(name, src.source(), order);
+        }, py::arg("name"), py::arg("source"), py::arg("order") = 0,
+           "Add StaticSource, sources with lower order are searched first")
         .def("listSource", &Server::listSource, "Return list[tuple] with source names and priority ranking")
         .def("start", &Server::start, "Start the Server")
-        .def("stop", &Server::stop, "Stop the Server")
-        .def("run", &Server::run, "Start the Server and block execution")
+        .def("stop", &Server::stop, py::call_guard<py::gil_scoped_release>(), "Stop the Server")
+        .def("run", &Server::run, py::call_guard<py::gil_scoped_release>(),
+                    "Start the Server and block execution")
         .def("interrupt", &Server::interrupt, "Queue a request to unblock run()")
+        .def("stats", [](Server& self) {
+            auto totals = ConnectionTotals::of(self);
+            py::dict py_stats;
+            py_stats["connections"] = totals.connections;
+            py_stats["channels"] = totals.channels;
+            py_stats["tx_bytes"] = totals.tx;
+            py_stats["rx_bytes"] = totals.rx;
+            return py_stats;
+        }, "Returns dictionary with the client connections, channels and bytes sent and received "
+           "of this Server, see process_stats() for handler metrics")
+        .def("prometheus", [](Server& self, const std::string& prefix) {
+            auto totals = ConnectionTotals::of(self);
+            std::ostringstream out;
+            prometheus_metric(out, prefix + "_connections", "gauge", totals.connections);
+            prometheus_metric(out, prefix + "_channels", "gauge", totals.channels);
+            prometheus_metric(out, prefix + "_tx_bytes", "gauge", totals.tx);
+            prometheus_metric(out, prefix + "_rx_bytes", "gauge", totals.rx);
+            return out.str();
+        }, py::arg("prefix") = "aiopvxs_server",
+           "Returns the metrics of stats() in Prometheus text exposition format")
 
         // python helper methods
         // implement a context manager protocol so users can run server using 'with' statement
@@ -115,6 +965,7 @@ void create_submodule_server(py::module_& m) {
         .def("__exit__", [](Server& self, py::object exc_type,
                                           py::object exc_value,
                                           py::object traceback) {
+            py::gil_scoped_release nogil;
             self.stop();
             // uncaught exceptions within the context manager are available
             //if (exc_type.is(py::none())) {
@@ -125,4 +976,21 @@ void create_submodule_server(py::module_& m) {
             ///}
         });
 
+    m.def("process_stats", [](bool reset) {
+        auto& stats = ProcessStats::instance();
+        py::dict py_stats = stats.to_python();
+        if (reset)
+            stats.reset();
+        return py_stats;
+    }, py::arg("reset") = false,
+       "Returns dictionary of runtime metrics of every SharedPV in this process: put/rpc "
+       "requests handled, failed and in flight with latency histograms, posts and the time "
+       "pvxs threads waited for the GIL");
+    m.def("process_prometheus", [](const std::string& prefix) {
+        std::ostringstream out;
+        ProcessStats::instance().prometheus(out, prefix);
+        return out.str();
+    }, py::arg("prefix") = "aiopvxs_server",
+       "Returns the metrics of process_stats() in Prometheus text exposition format");
+
 }
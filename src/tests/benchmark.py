@@ -0,0 +1,304 @@
+"""
+End-to-end benchmarks of aiopvxs against an in-process loopback server.
+
+Measures get/put/rpc operations per second and latency percentiles, monitor
+updates per second for payloads from a scalar up to 16 MB arrays, and the
+cost of converting Values to and from python objects. Results are written
+as JSON so they can be compared between commits:
+
+    python src/tests/benchmark.py --output before.json
+    python src/tests/benchmark.py --output after.json --compare before.json
+
+With --compare, exits with status 1 if any throughput dropped by more than
+--threshold percent. With --casters, native timings of the array type casters
+are added, which needs the optional aiopvxs_bench module (build with
+AIOPVXS_BENCH=1 pip install .).
+"""
+import argparse
+import array
+import asyncio
+import json
+import platform
+import statistics
+import subprocess
+import sys
+import time
+from datetime import datetime, timezone
+from pathlib import Path
+
+from aiopvxs.client import Context
+from aiopvxs.data import TypeCodeEnum as T
+from aiopvxs.nt import NTScalar
+from aiopvxs.server import Server, SharedPV
+
+# payload sizes in bytes of the float64 array PVs, 0 is a scalar
+PAYLOAD_SIZES = [0, 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024]
+
+
+def payload_name(size: int) -> str:
+    if size == 0:
+        return "scalar"
+    for unit, scale in (("MB", 1024 * 1024), ("KB", 1024)):
+        if size >= scale:
+            return f"{size // scale}{unit}"
+    return f"{size}B"
+
+
+def make_value(size: int):
+    if size == 0:
+        val = NTScalar(T.Float64).create()
+        val['value'] = 1.5
+    else:
+        val = NTScalar(T.Float64A).create()
+        val['value'] = array.array('d', [1.5]) * (size // 8)
+    return val
+
+
+def make_pvs(sizes):
+    def put_callback(pv, op, value):
+        pv.post(value)
+        op.reply()
+
+    def rpc_callback(pv, op, value):
+        op.reply(value)
+
+    pvs = {}
+    for size in sizes:
+        pv = SharedPV()
+        pv.onPut(put_callback)
+        pv.onRPC(rpc_callback)
+        pv.open(make_value(size))
+        pvs[f"bench:{payload_name(size)}"] = pv
+    return pvs
+
+
+def summarize(name: str, size: int, latencies: list, elapsed: float) -> dict:
+    # latencies in seconds, one per operation
+    ops = len(latencies)
+    ordered = sorted(latencies)
+    result = {
+        'name': name,
+        'payload': payload_name(size),
+        'bytes': size,
+        'ops': ops,
+        'ops_per_sec': ops / elapsed if elapsed > 0 else 0.0,
+    }
+    if ordered:
+        result['p50_us'] = ordered[int(0.50 * (ops - 1))] * 1e6
+        result['p99_us'] = ordered[int(0.99 * (ops - 1))] * 1e6
+        result['mean_us'] = statistics.fmean(ordered) * 1e6
+    if size:
+        result['mb_per_sec'] = result['ops_per_sec'] * size / (1024 * 1024)
+    return result
+
+
+async def time_async(make_op, duration: float, min_ops: int = 3) -> tuple:
+    latencies = []
+    start = time.perf_counter()
+    while True:
+        t0 = time.perf_counter()
+        await make_op()
+        t1 = time.perf_counter()
+        latencies.append(t1 - t0)
+        if t1 - start >= duration and len(latencies) >= min_ops:
+            return latencies, t1 - start
+
+
+def time_sync(op, duration: float, min_ops: int = 3) -> tuple:
+    latencies = []
+    start = time.perf_counter()
+    while True:
+        t0 = time.perf_counter()
+        op()
+        t1 = time.perf_counter()
+        latencies.append(t1 - t0)
+        if t1 - start >= duration and len(latencies) >= min_ops:
+            return latencies, t1 - start
+
+
+async def bench_operations(ctx: Context, sizes, duration: float) -> list:
+    results = []
+    for size in sizes:
+        name = f"bench:{payload_name(size)}"
+        # connect and warm up type caches before timing
+        current = await ctx.get(name)
+        new_data = {'value': current.value.as_py()}
+
+        latencies, elapsed = await time_async(lambda: ctx.get(name), duration)
+        results.append(summarize("get", size, latencies, elapsed))
+
+        latencies, elapsed = await time_async(lambda: ctx.put(name, new_data), duration)
+        results.append(summarize("put", size, latencies, elapsed))
+
+        if size == 0:
+            latencies, elapsed = await time_async(lambda: ctx.rpc(name, arg=1.5), duration)
+            results.append(summarize("rpc", size, latencies, elapsed))
+    return results
+
+
+async def bench_monitor(ctx: Context, pvs: dict, sizes, duration: float) -> list:
+    results = []
+    for size in sizes:
+        name = f"bench:{payload_name(size)}"
+        pv = pvs[name]
+        val = make_value(size)
+
+        sub = ctx.monitor(name)
+        try:
+            # initial update
+            await asyncio.wait_for(sub.pop(), timeout=10)
+
+            received = 0
+            posted = 0
+            start = time.perf_counter()
+            while time.perf_counter() - start < duration:
+                pv.post(val)
+                posted += 1
+                # let the event loop deliver what has arrived so far
+                batch = await asyncio.wait_for(sub.pop_batch(), timeout=10)
+                received += len(batch)
+            elapsed = time.perf_counter() - start
+        finally:
+            sub.cancel()
+
+        result = summarize("monitor", size, [], elapsed)
+        result['ops'] = received
+        result['ops_per_sec'] = received / elapsed
+        result['posted'] = posted
+        if size:
+            result['mb_per_sec'] = result['ops_per_sec'] * size / (1024 * 1024)
+        results.append(result)
+    return results
+
+
+def bench_conversions(sizes, duration: float) -> list:
+    results = []
+    for size in sizes:
+        val = make_value(size)
+        as_dict = val.as_dict()
+
+        latencies, elapsed = time_sync(val.as_dict, duration)
+        results.append(summarize("as_dict", size, latencies, elapsed))
+
+        target = val.cloneEmpty()
+        latencies, elapsed = time_sync(lambda: target.assign(as_dict), duration)
+        results.append(summarize("assign", size, latencies, elapsed))
+
+        if size:
+            data = array.array('d', [1.5]) * (size // 8)
+            field = val.value
+
+            def cast_in():
+                val['value'] = data
+            latencies, elapsed = time_sync(cast_in, duration)
+            results.append(summarize("array_from_buffer", size, latencies, elapsed))
+
+            latencies, elapsed = time_sync(field.as_list, duration)
+            results.append(summarize("array_as_list", size, latencies, elapsed))
+
+            latencies, elapsed = time_sync(lambda: memoryview(field.as_buffer()), duration)
+            results.append(summarize("array_as_buffer", size, latencies, elapsed))
+    return results
+
+
+def bench_casters(duration: float) -> list:
+    import aiopvxs_bench
+
+    results = []
+    for timing in aiopvxs_bench.bench_casters(min_time=duration / 5):
+        result = {
+            'name': f"caster_{timing['case']}",
+            'payload': f"{timing['format']}x{timing['items']}",
+            'ops_per_sec': 1e9 / timing['ns_per_call'],
+            'mb_per_sec': timing['bytes_per_sec'] / (1024 * 1024),
+        }
+        result.update(timing)
+        results.append(result)
+    return results
+
+
+def git_commit() -> str:
+    try:
+        return subprocess.run(["git", "rev-parse", "--short", "HEAD"], capture_output=True,
+                              text=True, cwd=Path(__file__).parent, check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return ""
+
+
+def compare(results: list, baseline_path: str, threshold: float) -> bool:
+    # returns True if no benchmark is slower than baseline by more than threshold percent
+    baseline = json.loads(Path(baseline_path).read_text())
+    previous = {(r['name'], r['payload']): r for r in baseline['results']}
+    passed = True
+
+    print(f"\n{'benchmark':<28} {'baseline':>14} {'current':>14} {'change':>9}")
+    for result in results:
+        key = (result['name'], result['payload'])
+        if key not in previous or previous[key]['ops_per_sec'] == 0:
+            continue
+        change = 100.0 * (result['ops_per_sec'] / previous[key]['ops_per_sec'] - 1.0)
+        flag = ""
+        if change < -threshold:
+            flag = "  REGRESSION"
+            passed = False
+        print(f"{result['name'] + ' ' + result['payload']:<28} "
+              f"{previous[key]['ops_per_sec']:>14.1f} {result['ops_per_sec']:>14.1f} "
+              f"{change:>8.1f}%{flag}")
+    return passed
+
+
+async def run(args) -> list:
+    sizes = [size for size in PAYLOAD_SIZES if size <= args.max_bytes]
+    pvs = make_pvs(sizes)
+    results = []
+
+    results += bench_conversions(sizes, args.duration)
+    if args.casters:
+        results += bench_casters(args.duration)
+    with Server(pvs):
+        ctx = Context()
+        results += await bench_operations(ctx, sizes, args.duration)
+        results += await bench_monitor(ctx, pvs, sizes, args.duration)
+        ctx.close()
+
+    for pv in pvs.values():
+        pv.close()
+    return results
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--duration", type=float, default=1.0,
+                        help="seconds to run each benchmark (default: %(default)s)")
+    parser.add_argument("--max-bytes", type=int, default=PAYLOAD_SIZES[-1],
+                        help="largest array payload in bytes (default: %(default)s)")
+    parser.add_argument("--casters", action="store_true",
+                        help="add native type caster timings from the aiopvxs_bench module")
+    parser.add_argument("--output", help="write JSON results to this file instead of stdout")
+    parser.add_argument("--compare", metavar="BASELINE", help="JSON results to compare against")
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="allowed throughput drop in percent with --compare (default: %(default)s)")
+    args = parser.parse_args()
+
+    results = asyncio.run(run(args))
+    report = {
+        'commit': git_commit(),
+        'date': datetime.now(timezone.utc).isoformat(timespec="seconds"),
+        'python': sys.version.split()[0],
+        'platform': platform.platform(),
+        'duration': args.duration,
+        'results': results,
+    }
+
+    if args.output:
+        Path(args.output).write_text(json.dumps(report, indent=2) + "\n")
+    else:
+        print(json.dumps(report, indent=2))
+
+    if args.compare and not compare(results, args.compare, args.threshold):
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
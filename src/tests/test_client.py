@@ -1,14 +1,22 @@
 import logging
+import sys
+import threading
+import time
 from asyncio import (CancelledError, Future, Queue, all_tasks, create_task,
-                     current_task, gather, sleep, timeout, wait_for)
+                     current_task, gather, get_running_loop, new_event_loop,
+                     sleep, timeout, wait_for)
+from concurrent.futures import ThreadPoolExecutor
 
 import pytest
 
-from aiopvxs.client import (Context, Disconnected, Discovered, RemoteError,
+from aiopvxs.client import (Context, Disconnected, Discovered,
+                            LatestSubscription, OverflowEnum, RemoteError,
                             Subscription)
 from aiopvxs.data import TypeCodeEnum as T
 from aiopvxs.data import Value
-from aiopvxs.server import Server
+from aiopvxs.nt import NTScalar
+from aiopvxs.server import (DynamicSource, Server, SharedPV, StaticSource,
+                            process_prometheus, process_stats)
 
 _log = logging.getLogger(__file__)
 
@@ -73,6 +81,41 @@ class TestClientRPC:
         assert float(val.query.some_float) == 999.9
         assert str(val.query.some_string) == "a string"
 
+    async def test_rpc_closed_loop(self, pvxs_test_context : Context,
+                                   monkeypatch : pytest.MonkeyPatch):
+        client = pvxs_test_context
+        dropped = []
+        monkeypatch.setattr(sys, "unraisablehook", dropped.append)
+
+        def rpc_callback(pv, op, value):
+            # reply after the requested delay
+            time.sleep(float(value.query.delay))
+            op.reply(value)
+
+        pv = SharedPV(nt=NTScalar(T.Int32).build(), initial={'value': 0})
+        pv.onRPC(rpc_callback)
+        with Server({"delayed:pv": pv}):
+            await wait_for(client.get("delayed:pv"), timeout=3)
+
+            def start_and_close_loop():
+                async def start():
+                    return [client.rpc("delayed:pv", delay=delay) for delay in (0.1, 0.6)]
+                loop = new_event_loop()
+                rpc_ops = loop.run_until_complete(start())
+                loop.close()
+                return rpc_ops
+
+            # results arrive one by one after their event loop was closed
+            rpc_ops = await get_running_loop().run_in_executor(None, start_and_close_loop)
+            await sleep(1.5)
+            assert not any(rpc_op.done() for rpc_op in rpc_ops)
+            assert len(dropped) == 2
+
+            # other event loops are not affected
+            val = await wait_for(client.rpc("delayed:pv", delay=0.0), timeout=3)
+            assert float(val.query.delay) == 0.0
+        pv.close()
+
 
 @pytest.mark.asyncio
 class TestClientGetPut:
@@ -91,6 +134,18 @@ class TestClientGetPut:
         assert 'timeStamp' in val.as_dict()
 
         assert int(val.value) == -42
+
+    async def test_get_fields(self, pvxs_test_server : Server,
+                              pvxs_test_context : Context):
+        server = pvxs_test_server
+        client = pvxs_test_context
+
+        val = await wait_for(client.get("scalar_int32", fields=['value']), timeout=3)
+        assert int(val.value) == -42
+        assert 'alarm' not in val.as_dict()
+
+        val = await wait_for(client.get("scalar_int32", request="field(value,timeStamp)"), timeout=3)
+        assert set(val.as_dict().keys()) == {'value', 'timeStamp'}
     
     async def test_put_value(self, pvxs_test_server : Server,
                        pvxs_test_context : Context):
@@ -107,6 +162,76 @@ class TestClientGetPut:
         assert str(val.value) == "minus forty-three"
         assert str(val.alarm.message) == "OK"
 
+    async def test_put_type_cache(self, pvxs_test_server : Server):
+        server = pvxs_test_server
+        client = Context(type_cache=True)
+
+        # first put fetches the type, the others use the cached type
+        for i in range(5):
+            await wait_for(client.put("scalar_int32", {'value': i}), timeout=3)
+            val = await client.get("scalar_int32")
+            assert int(val.value) == i
+
+        with pytest.raises(KeyError):
+            await wait_for(client.put("scalar_int32", {'nonexistent': 0}), timeout=3)
+        with pytest.raises(TypeError):
+            await wait_for(client.put("scalar_int32", {'value': "not a number"}), timeout=3)
+
+        # writing more PVs than fit in the cache evicts the least recently used
+        client = Context(type_cache=True, type_cache_size=1)
+        for i in range(3):
+            await wait_for(client.put("scalar_int32", {'value': i}), timeout=3)
+            await wait_for(client.put("scalar_string", {'value': str(i)}), timeout=3)
+            val = await client.get("scalar_int32")
+            assert int(val.value) == i
+            val = await client.get("scalar_string")
+            assert str(val.value) == str(i)
+
+    async def test_get_concurrent(self, pvxs_test_server : Server,
+                                  pvxs_test_context : Context):
+        server = pvxs_test_server
+        client = pvxs_test_context
+
+        # results of many operations completing together are delivered
+        # to the event loop in batches, each Future must still resolve
+        get_ops = [client.get("scalar_int32") for _ in range(100)]
+        vals = await wait_for(gather(*get_ops), timeout=3)
+        assert len(vals) == 100
+        assert all(int(val.value) == -42 for val in vals)
+
+    async def test_get_many(self, pvxs_test_server : Server,
+                            pvxs_test_context : Context):
+        server = pvxs_test_server
+        client = pvxs_test_context
+
+        get_op = client.get_many(["scalar_int32", "scalar_string"])
+        assert isinstance(get_op, Future)
+        vals = await wait_for(get_op, timeout=3)
+        assert len(vals) == 2
+        assert int(vals[0].value) == -42
+        assert str(vals[1].value) == "minus forty-two"
+
+        assert await client.get_many([]) == []
+
+    async def test_put_many(self, pvxs_test_server : Server,
+                            pvxs_test_context : Context):
+        server = pvxs_test_server
+        client = pvxs_test_context
+
+        put_op = client.put_many({
+            "scalar_int32": {'value': 43},
+            "scalar_string": {'nonexistent': "forty-three"},
+        })
+        assert isinstance(put_op, Future)
+        vals = await wait_for(put_op, timeout=3)
+        assert len(vals) == 2
+        # exceptions are returned in place of the result
+        assert isinstance(vals[0], Value)
+        assert isinstance(vals[1], KeyError)
+
+        val = await client.get("scalar_int32")
+        assert int(val.value) == 43
+
     async def test_get_cancel(self, pvxs_test_context : Context):
         client = pvxs_test_context
 
@@ -224,4 +349,372 @@ class TestEventCallbacks:
             monitor_op.cancel()
 
         # fail if loop did not iterate the expected number of times
-        assert next_val == 0
\ No newline at end of file
+        assert next_val == 0
+
+    async def test_monitor_batches(self, pvxs_test_server : Server,
+                                   pvxs_test_context : Context):
+        server = pvxs_test_server
+        client = pvxs_test_context
+
+        monitor_op = client.monitor("scalar_int32")
+        assert isinstance(monitor_op, Subscription)
+
+        received = []
+        try:
+            async with timeout(3):
+                async for batch in monitor_op.batches(max=4):
+                    assert isinstance(batch, list)
+                    assert 0 < len(batch) <= 4
+                    received += [val.value.as_int() for val in batch
+                                 if isinstance(val, Value)]
+                    if not received:
+                        continue
+                    elif received[-1] >= 0:
+                        break
+                    # several puts before the next iteration
+                    for i in range(received[-1] + 1, min(received[-1] + 4, 0) + 1):
+                        await client.put("scalar_int32", {'value': i})
+        finally:
+            monitor_op.cancel()
+
+        # fail if updates were re-ordered or the last update never arrived
+        assert received[0] == -42
+        assert received == sorted(received)
+        assert received[-1] == 0
+
+    async def test_monitor_overflow(self, pvxs_test_server : Server,
+                                    pvxs_test_context : Context):
+        server = pvxs_test_server
+        client = pvxs_test_context
+
+        for overflow in (OverflowEnum.DropOldest, OverflowEnum.Coalesce, OverflowEnum.Block):
+            await client.put("scalar_int32", {'value': -42})
+            monitor_op = client.monitor("scalar_int32", queue_size=2, overflow=overflow)
+
+            # many updates while nothing is consumed
+            for i in range(-41, 0):
+                await client.put("scalar_int32", {'value': i})
+            await sleep(0.2)
+
+            received = []
+            try:
+                async with timeout(3):
+                    while not received or received[-1] != -1:
+                        batch = await monitor_op.pop_batch()
+                        assert len(batch) <= 2
+                        received += [val.value.as_int() for val in batch]
+            finally:
+                monitor_op.cancel()
+
+            # queue never grows past queue_size, the latest update is never lost
+            assert received == sorted(received)
+            assert len(received) < 42
+            if overflow == OverflowEnum.DropOldest:
+                assert monitor_op.stats()['dropped'] > 0
+
+    async def test_monitor_conflate(self, pvxs_test_server : Server,
+                                    pvxs_test_context : Context):
+        server = pvxs_test_server
+        client = pvxs_test_context
+
+        monitor_op = client.monitor("scalar_int32", conflate=True)
+        assert isinstance(monitor_op, LatestSubscription)
+        try:
+            val = await wait_for(monitor_op.pop(), timeout=3)
+            assert val.value.as_int() == -42
+            assert not monitor_op.overwritten
+            assert monitor_op.latest() is None
+
+            # many updates while nothing is consumed, only the latest is kept
+            for i in range(-41, 0):
+                await client.put("scalar_int32", {'value': i})
+            await sleep(0.2)
+
+            val = await wait_for(monitor_op.pop(), timeout=3)
+            assert val.value.as_int() == -1
+            assert monitor_op.overwritten
+            assert monitor_op.latest() is None
+        finally:
+            monitor_op.cancel()
+
+    async def test_monitor_into(self, pvxs_test_server : Server,
+                                pvxs_test_context : Context):
+        server = pvxs_test_server
+        client = pvxs_test_context
+
+        # updates are copied into the same dict, no new object per update
+        latest = {}
+        monitor_op = client.monitor("scalar_int32", into=latest)
+        assert isinstance(monitor_op, LatestSubscription)
+        try:
+            val = await wait_for(monitor_op.pop(), timeout=3)
+            assert val is latest
+            assert latest['value'] == -42
+            alarm = latest['alarm']
+
+            await client.put("scalar_int32", {'value': 7})
+            val = await wait_for(monitor_op.pop(), timeout=3)
+            assert val is latest
+            assert latest['value'] == 7
+            assert latest['alarm'] is alarm
+        finally:
+            monitor_op.cancel()
+
+        # or into a Value
+        target = NTScalar(T.Int32).create()
+        monitor_op = client.monitor("scalar_int32", into=target)
+        try:
+            val = await wait_for(monitor_op.pop(), timeout=3)
+            assert val is target
+            assert target.value.as_int() == 7
+        finally:
+            monitor_op.cancel()
+
+        # into= only keeps the latest update, so it can not be queued
+        with pytest.raises(ValueError):
+            client.monitor("scalar_int32", into={}, queue_size=4)
+        with pytest.raises(ValueError):
+            client.monitor("scalar_int32", into={}, overflow=OverflowEnum.Coalesce)
+        with pytest.raises(ValueError):
+            client.monitor("scalar_int32", conflate=True, queue_size=4)
+
+    async def test_stats(self, pvxs_test_server : Server,
+                         pvxs_test_context : Context):
+        server = pvxs_test_server
+        client = pvxs_test_context
+
+        await wait_for(client.get("scalar_int32"), timeout=3)
+        await wait_for(client.put("scalar_string", {'value': "stats"}), timeout=3)
+        with pytest.raises(RuntimeError):
+            await wait_for(client.rpc("scalar_int32"), timeout=3)
+        monitor_op = client.monitor("scalar_int32")
+        await wait_for(monitor_op.pop(), timeout=3)
+        monitor_op.cancel()
+
+        stats = client.stats()
+        assert stats['get']['issued'] == 1 and stats['get']['completed'] == 1
+        assert stats['get']['in_flight'] == 0
+        assert stats['get']['latency']['count'] == 1
+        assert stats['put']['completed'] == 1
+        assert stats['rpc']['failed'] == 1
+        assert stats['monitor']['subscriptions'] == 1
+        assert stats['monitor']['updates'] >= 1
+
+        text = client.prometheus()
+        assert 'aiopvxs_client_ops_completed_total{op="get"} 1' in text
+        assert 'aiopvxs_client_op_latency_seconds_bucket{op="get",le="+Inf"} 1' in text
+
+        # put handler of the test server ran
+        assert process_stats()['put']['completed'] >= 1
+        assert '# TYPE aiopvxs_server_posts_total counter' in process_prometheus()
+
+        # connections are counted per Server
+        assert server.stats()['connections'] >= 1
+        assert server.stats()['rx_bytes'] > 0
+        assert '# TYPE aiopvxs_server_connections gauge' in server.prometheus()
+        idle_server = Server({})
+        assert idle_server.stats() == {'connections': 0, 'channels': 0, 'tx_bytes': 0, 'rx_bytes': 0}
+
+        client.stats(reset=True)
+        assert client.stats()['get']['issued'] == 0
+
+
+@pytest.mark.asyncio
+class TestServerSources:
+
+    async def test_dynamic_source(self, pvxs_test_context : Context):
+        client = pvxs_test_context
+        created = []
+
+        def on_create(name):
+            created.append(name)
+            val = NTScalar(T.Int32).create()
+            val['value'] = int(name.split(':')[-1])
+            return val
+
+        src = DynamicSource(prefixes=["dyn:"], on_create=on_create)
+        server = Server()
+        server.addSource("dynamic", src)
+        with server:
+            vals = await wait_for(client.get_many(["dyn:1", "dyn:2", "dyn:1"]), timeout=3)
+            assert [int(val.value) for val in vals] == [1, 2, 1]
+
+            # PVs are created once, on first connect
+            assert sorted(created) == ["dyn:1", "dyn:2"]
+            assert sorted(src.list()) == ["dyn:1", "dyn:2"]
+
+        with pytest.raises(ValueError):
+            DynamicSource(prefixes=["dyn:"])
+
+    async def test_dynamic_source_eviction(self):
+        client = Context()
+        events = []
+
+        def on_create(name):
+            pv = SharedPV(nt=NTScalar(T.Int32).build(), initial={'value': 0})
+            # hooks installed by on_create are kept by the DynamicSource
+            pv.onFirstConnect(lambda pv: events.append("first_connect"))
+            pv.onLastDisconnect(lambda pv: events.append("last_disconnect"))
+            return pv
+
+        def on_evict(name, pv):
+            events.append("evict")
+
+        src = DynamicSource(prefixes=["idle:"], on_create=on_create, on_evict=on_evict,
+                            idle_timeout=0.2)
+        server = Server()
+        server.addSource("dynamic", src)
+        with server:
+            await wait_for(client.get("idle:1"), timeout=3)
+            assert src.list() == ["idle:1"]
+
+            # evicted without new clients or calling sweep()
+            client.close()
+            await sleep(1.0)
+            assert src.list() == []
+            assert events == ["first_connect", "last_disconnect", "evict"]
+
+    async def test_post_many(self, pvxs_test_context : Context):
+        client = pvxs_test_context
+
+        pvs = {f"bulk:{i}": SharedPV(nt=NTScalar(T.Float64).build(), initial={'value': 0.0})
+               for i in range(10)}
+        src = StaticSource(pvs)
+        server = Server()
+        server.addSource("bulk", src)
+        with server:
+            src.post_many({name: {'value': float(i)} for i, name in enumerate(pvs)})
+            vals = await wait_for(client.get_many(list(pvs)), timeout=3)
+            assert [float(val.value) for val in vals] == [float(i) for i in range(10)]
+
+            SharedPV.post_many({pv: {'value': -1.0} for pv in pvs.values()})
+            vals = await wait_for(client.get_many(list(pvs)), timeout=3)
+            assert all(float(val.value) == -1.0 for val in vals)
+
+            # nothing is posted if one update is bad
+            with pytest.raises(KeyError):
+                src.post_many({"bulk:0": {'value': 1.0}, "nonexistent": {'value': 1.0}})
+            val = await wait_for(client.get("bulk:0"), timeout=3)
+            assert float(val.value) == -1.0
+
+    async def test_async_handlers(self, pvxs_test_context : Context):
+        client = pvxs_test_context
+
+        async def put_callback(pv, op, value):
+            await sleep(0.01)
+            pv.post(value)
+            op.reply()
+
+        async def rpc_callback(pv, op, value):
+            raise ValueError("no such record")
+
+        pv = SharedPV(nt=NTScalar(T.Int32).build(), initial={'value': 0})
+        pv.onPut(put_callback, loop=get_running_loop())
+        pv.onRPC(rpc_callback, loop=get_running_loop())
+        with Server({"async:pv": pv}):
+            # handlers run on this event loop, which must not be blocked
+            await wait_for(gather(*[client.put("async:pv", {'value': i}) for i in range(10)]), timeout=3)
+            val = await wait_for(client.get("async:pv"), timeout=3)
+            assert 0 <= int(val.value) < 10
+
+            with pytest.raises(RuntimeError, match="no such record"):
+                await wait_for(client.rpc("async:pv"), timeout=3)
+        pv.close()
+
+    async def test_async_handler_without_loop(self, pvxs_test_context : Context):
+        client = pvxs_test_context
+
+        async def rpc_callback(pv, op, value):
+            return value
+
+        pv = SharedPV(nt=NTScalar(T.Int32).build(), initial={'value': 0})
+        # installed while the event loop runs, the handler runs on it
+        pv.onRPC(rpc_callback)
+        with Server({"noloop:pv": pv}):
+            val = await wait_for(client.rpc("noloop:pv", index=1), timeout=3)
+            assert int(val.query.index) == 1
+
+        # no event loop to run it on
+        def install():
+            pv.onRPC(rpc_callback)
+        with pytest.raises(ValueError, match="event loop"):
+            await get_running_loop().run_in_executor(None, install)
+        pv.close()
+
+    async def test_executor_async_handler(self, pvxs_test_context : Context):
+        client = pvxs_test_context
+
+        async def rpc_callback(pv, op, value):
+            await sleep(0.01)
+            return value
+
+        pv = SharedPV(nt=NTScalar(T.Int32).build(), initial={'value': 0})
+        with ThreadPoolExecutor(max_workers=2) as executor:
+            # called on an executor thread, the task runs on this event loop
+            pv.onRPC(rpc_callback, executor=executor)
+            with Server({"executor:pv": pv}):
+                rpc_ops = [client.rpc("executor:pv", index=i) for i in range(4)]
+                vals = await wait_for(gather(*rpc_ops), timeout=3)
+                assert [int(val.query.index) for val in vals] == list(range(4))
+        pv.close()
+
+    async def test_blocking_calls_release_gil(self):
+        count = 0
+        counting = threading.Event()
+
+        def counter():
+            nonlocal count
+            while counting.is_set():
+                count += 1
+
+        counting.set()
+        counter_thread = threading.Thread(target=counter)
+        counter_thread.start()
+        try:
+            pv = SharedPV(nt=NTScalar(T.Int32).build(), initial={'value': 0})
+            server = Server({"gil:pv": pv})
+            # run() blocks until interrupt(), the counter thread only makes
+            # progress meanwhile if run() released the GIL
+            runner = threading.Thread(target=server.run)
+            runner.start()
+            for _ in range(3):
+                before = count
+                time.sleep(0.1)
+                assert runner.is_alive()
+                assert count > before
+            server.interrupt()
+            runner.join(timeout=3)
+            assert not runner.is_alive()
+
+            # stop() and close() return too quickly to tell if they release
+            # the GIL, only check they complete while another thread runs
+            server.start()
+            server.stop()
+            pv.close()
+            Context().close()
+        finally:
+            counting.clear()
+            counter_thread.join()
+
+    async def test_async_handler_limit(self, pvxs_test_context : Context):
+        client = pvxs_test_context
+        in_flight = 0
+        max_in_flight = 0
+
+        async def rpc_callback(pv, op, value):
+            nonlocal in_flight, max_in_flight
+            in_flight += 1
+            max_in_flight = max(in_flight, max_in_flight)
+            await sleep(0.05)
+            in_flight -= 1
+            # returned Value is the reply
+            return value
+
+        pv = SharedPV(nt=NTScalar(T.Int32).build(), initial={'value': 0})
+        pv.onRPC(rpc_callback, loop=get_running_loop(), max_in_flight=2)
+        with Server({"limited:pv": pv}):
+            rpc_ops = [client.rpc("limited:pv", index=i) for i in range(6)]
+            vals = await wait_for(gather(*rpc_ops), timeout=3)
+            assert [int(val.query.index) for val in vals] == list(range(6))
+            assert max_in_flight == 2
+        pv.close()
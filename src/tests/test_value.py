@@ -1,11 +1,12 @@
 import array
 import logging
+from fractions import Fraction
 
 import pytest
 
 from aiopvxs.data import TypeCodeEnum as T
-from aiopvxs.data import Value
-from aiopvxs.nt import NTEnum, NTScalar
+from aiopvxs.data import FieldRef, Value, extract
+from aiopvxs.nt import NTEnum, NTNDArray, NTScalar, NTTable
 
 _log = logging.getLogger(__file__)
 
@@ -143,6 +144,134 @@ class TestValueCasts:
         with pytest.raises(TypeError, match="'float' object cannot be interpreted as an integer"):
             assert nt_value.value.as_int_list() == [int(x) for x in py_value]
 
+    def test_array_buffer(self, nt_integer_arrays : tuple):
+        nt_type, pyarray_type, py_value = nt_integer_arrays
+
+        nt_value = nt_type.create()
+        nt_value['value'] = array.array(pyarray_type, py_value)
+        buf = nt_value.value.as_buffer()
+        assert len(buf) == len(py_value)
+
+        mv = memoryview(buf)
+        assert mv.readonly
+        assert mv.format == pyarray_type
+        assert mv.tolist() == py_value
+
+        # buffer outlives the Value it was made from
+        del nt_value, buf
+        assert mv.tolist() == py_value
+
+        with pytest.raises(TypeError):
+            NTScalar(T.StringA).create().value.as_buffer()
+
+    def test_readonly_buffer(self, nt_float_arrays : tuple):
+        nt_type, pyarray_type, py_value = nt_float_arrays
+
+        # read-only buffer storage is shared with the Value (no copy)
+        py_array = array.array(pyarray_type, py_value)
+        nt_value = nt_type.create()
+        nt_value['value'] = memoryview(py_array).toreadonly()
+        assert nt_value.value.as_list() == py_array.tolist()
+        # exported buffer can not be resized while Value holds it
+        with pytest.raises(BufferError):
+            py_array.append(0.0)
+        del nt_value
+        py_array.append(0.0)
+
+        # writable buffer is copied, later changes are not seen by the Value
+        py_array = array.array(pyarray_type, py_value)
+        nt_value = nt_type.create()
+        nt_value['value'] = py_array
+        py_array[0] = 0.0
+        assert nt_value.value.as_list()[0] != 0.0
+
+        # strided and reversed views are copied item by item
+        py_array = array.array(pyarray_type, py_value)
+        nt_value['value'] = memoryview(py_array)[::-1]
+        assert nt_value.value.as_list() == py_array.tolist()[::-1]
+        nt_value['value'] = memoryview(py_array).toreadonly()[::-2]
+        assert nt_value.value.as_list() == py_array.tolist()[::-2]
+
+    def test_table_columns(self):
+        table = NTTable([(T.Float64A, 'x'), (T.Int32A, 'n')])
+        table.add_column(T.StringA, 'name', 'Name')
+        nt_value = table.create()
+        nt_value['value.x'] = array.array('d', [0.5, 1.5, 2.5])
+        nt_value['value.n'] = [1, 2, 3]
+        nt_value['value.name'] = ["a", "b", "c"]
+        assert nt_value.labels.as_list() == ['x', 'n', 'Name']
+
+        columns = nt_value.columns()
+        assert list(columns.keys()) == ['x', 'n', 'name']
+        assert memoryview(columns['x']).tolist() == [0.5, 1.5, 2.5]
+        assert memoryview(columns['n']).format == 'i'
+        assert columns['name'] == ["a", "b", "c"]
+        # also works on the 'value' sub-structure
+        assert nt_value.value.columns().keys() == columns.keys()
+
+    def test_update_into(self):
+        nt_value = NTScalar(T.Float64A).create()
+        nt_value['value'] = array.array('d', [1.0, 2.0, 3.0])
+
+        out = array.array('d', [0.0] * 3)
+        assert nt_value.update_into(out) is out
+        assert out.tolist() == [1.0, 2.0, 3.0]
+        with pytest.raises(TypeError):
+            nt_value.update_into(array.array('f', [0.0] * 3))
+        with pytest.raises(ValueError):
+            nt_value.update_into(array.array('d', [0.0] * 2))
+
+        out = {'alarm': {}}
+        alarm = out['alarm']
+        nt_value['alarm.severity'] = 2
+        assert nt_value.update_into(out) is out
+        assert out['alarm'] is alarm and alarm['severity'] == 2
+        assert out['value'] == [1.0, 2.0, 3.0]
+
+    def test_ndarray_image(self):
+        pixels = memoryview(array.array('H', range(6))).cast('B').cast('H', (2, 3))
+        nt_value = NTNDArray().create()
+        NTNDArray.set_image(nt_value, pixels)
+        assert [dim['size'] for dim in nt_value.dimension.as_py()] == [3, 2]
+
+        image = NTNDArray.image(nt_value)
+        assert image.shape == [2, 3]
+        view = memoryview(image)
+        assert view.format == 'H' and view.shape == (2, 3)
+        assert view.tolist() == [[0, 1, 2], [3, 4, 5]]
+
+        # compressed images are decoded by the registered codec
+        nt_value['codec.name'] = 'invert'
+        with pytest.raises(ValueError):
+            NTNDArray.image(nt_value)
+        NTNDArray.register_codec('invert', lambda data, value: array.array('H', [5 - x for x in memoryview(data)]))
+        try:
+            assert memoryview(NTNDArray.image(nt_value)).tolist() == [[5, 4, 3], [2, 1, 0]]
+        finally:
+            NTNDArray.register_codec('invert', None)
+
+        # real decoders return bytes, the item format comes from codec.parameters
+        compressed = NTNDArray().create()
+        NTNDArray.set_image(compressed, memoryview(bytes(48)).cast('d', (2, 3)))
+        compressed['codec.name'] = 'raw'
+        compressed['codec.parameters'] = 9  # NDFloat64
+        pixels = array.array('d', [0.5, 1.5, 2.5, 3.5, 4.5, 5.5])
+        NTNDArray.register_codec('raw', lambda data, value: pixels.tobytes())
+        try:
+            view = memoryview(NTNDArray.image(compressed))
+            assert view.format == 'd' and view.shape == (2, 3)
+            assert view.tolist() == [[0.5, 1.5, 2.5], [3.5, 4.5, 5.5]]
+
+            # size of the decoded image must match the shape
+            pixels = array.array('d', [0.5])
+            with pytest.raises(ValueError):
+                NTNDArray.image(compressed)
+        finally:
+            NTNDArray.register_codec('raw', None)
+
+        with pytest.raises(TypeError):
+            NTNDArray.set_image(nt_value, memoryview(b'text').cast('c'))
+
     def test_sequence_of_strings(self):
         test_strings = ["Hello, 👋", "from", "the", "python", "side"]
 
@@ -163,6 +292,93 @@ class TestValueCasts:
         assert nt_value.timeStamp.as_dict().items() >= test_dict['timeStamp'].items()
         assert nt_value.value.as_py() == test_dict['value']
 
+    def test_assign_plan(self):
+        prototype = NTScalar(T.Float64).create()
+        plan = prototype.compile_assign(['value', 'alarm.severity', 'timeStamp.userTag'])
+        assert plan.keys() == ['value', 'alarm.severity', 'timeStamp.userTag']
+
+        for i in range(10):
+            nt_value = prototype.cloneEmpty()
+            plan.apply(nt_value, {'value': i / 2, 'alarm.severity': i, 'timeStamp.userTag': 2**40})
+            assert float(nt_value.value) == i / 2
+            assert int(nt_value.alarm.severity) == i
+            assert int(nt_value.timeStamp.userTag) == 2**40
+
+        # missing keys are skipped, keys outside the plan take the slow path
+        nt_value = prototype.cloneEmpty()
+        plan.apply(nt_value, {'value': 1, 'alarm.message': "minor"})
+        assert float(nt_value.value) == 1.0
+        assert str(nt_value.alarm.message) == "minor"
+
+        # scalars that are not python int/float, eg. numpy scalars, which are
+        # also zero-dimensional buffers
+        class Index:
+            def __index__(self):
+                return 7
+
+        nt_value = prototype.cloneEmpty()
+        plan.apply(nt_value, {'value': memoryview(array.array('f', [2.5])).cast('B').cast('f', ()),
+                              'alarm.severity': Index()})
+        assert float(nt_value.value) == 2.5
+        assert int(nt_value.alarm.severity) == 7
+        nt_value.assign({'value': Fraction(1, 4),
+                         'alarm.severity': memoryview(array.array('q', [3])).cast('B').cast('q', ())})
+        assert float(nt_value.value) == 0.25
+        assert int(nt_value.alarm.severity) == 3
+
+        with pytest.raises(KeyError):
+            prototype.compile_assign(['nonexistant'])
+        with pytest.raises(TypeError):
+            plan.apply(prototype.cloneEmpty(), {'value': object()})
+
+    def test_extract(self):
+        updates = []
+        for i in range(5):
+            nt_value = NTScalar(T.Float64).create()
+            nt_value['value'] = i * 1.5
+            nt_value['timeStamp.secondsPastEpoch'] = 1000 + i
+            nt_value['alarm.message'] = f"update {i}"
+            updates.append(nt_value)
+
+        columns = extract(updates, ['value', 'timeStamp.secondsPastEpoch', 'alarm.message'])
+        assert memoryview(columns['value']).format == 'd'
+        assert memoryview(columns['value']).tolist() == [0.0, 1.5, 3.0, 4.5, 6.0]
+        assert memoryview(columns['timeStamp.secondsPastEpoch']).tolist() == [1000, 1001, 1002, 1003, 1004]
+        assert columns['alarm.message'] == [f"update {i}" for i in range(5)]
+
+        assert len(extract([], ['value'])['value']) == 0
+        with pytest.raises(KeyError):
+            # last Value has no timeStamp
+            extract(updates + [NTScalar(T.Float64).create().value], ['timeStamp.secondsPastEpoch'])
+        with pytest.raises(TypeError):
+            extract(updates, ['alarm'])
+
+    def test_field_ref(self):
+        severity = FieldRef(NTScalar(T.Float64).build(), 'alarm.severity')
+        value = NTScalar(T.Float64).create().field_ref('value')
+        assert severity.path == 'alarm.severity'
+        assert value.code == T.Float64
+
+        for i in range(10):
+            nt_value = NTScalar(T.Float64).create()
+            value.set(nt_value, i / 2)
+            severity.set(nt_value, i)
+            assert value.get_float(nt_value) == i / 2
+            assert value.get(nt_value) == i / 2
+            assert severity.get_int(nt_value) == i
+            assert int(severity.field(nt_value)) == i
+
+        with pytest.raises(KeyError):
+            FieldRef(NTScalar(T.Float64).create(), 'nonexistant')
+        with pytest.raises(KeyError):
+            severity.get_int(NTEnum().create().value)
+
+        # same path, different type
+        with pytest.raises(TypeError):
+            value.get(NTScalar(T.Int32).create())
+        with pytest.raises(TypeError):
+            value.set(NTScalar(T.String).create(), 1.5)
+
 
 class TestValueOps:
 
@@ -175,6 +391,18 @@ class TestValueOps:
         assert nt_value.get('nonexistant') == None
         assert nt_value.get('nonexistant', {}) == {}
 
+    def test_marked_only(self):
+        nt_value = NTScalar(T.Int32).create()
+        nt_value['value'] = 42
+        nt_value['alarm.severity'] = 1
+
+        assert nt_value.as_dict(marked_only=True) == {'value': 42, 'alarm': {'severity': 1}}
+        assert nt_value.as_py(marked_only=True) == nt_value.as_dict(marked_only=True)
+        assert 'timeStamp' in nt_value.as_dict()
+
+        nt_value.unmark()
+        assert nt_value.as_dict(marked_only=True) == {}
+
     def test_value_iteration(self, nt_enum_init_dict):
         test_dict = nt_enum_init_dict
         nt_value = NTEnum().create()
@@ -204,3 +432,19 @@ class TestValueOps:
         assert nt_value1.as_dict() == nt_value1.as_dict()
         assert nt_value1 != nt_value2
         assert nt_value1.as_dict() != nt_value2.as_dict()
+
+    def test_value_equality_tolerance(self):
+        nt_value1 = NTScalar(T.Float64A).create()
+        nt_value1['value'] = [1.0, 2.0, 3.0]
+        nt_value2 = NTScalar(T.Float64A).create()
+        nt_value2['value'] = [1.0, 2.0, 3.0 + 1e-9]
+
+        assert nt_value1 != nt_value2
+        assert nt_value1.value != nt_value2.value
+        assert nt_value1.equalValue(nt_value2, tolerance=1e-6)
+        assert not nt_value1.equalValue(nt_value2, tolerance=1e-12)
+
+        # same contents, different types
+        nt_value3 = NTScalar(T.Int64A).create()
+        nt_value3['value'] = [1, 2, 3]
+        assert nt_value1 != nt_value3